@@ -25,12 +25,22 @@
 #include <linux/types.h>	/* size_t */
 #include <linux/cdev.h>
 #include <linux/mutex.h>  // for mutex
+#include <linux/io_uring/cmd.h> // uring_cmd
+#include <linux/mm.h> // mmap of the stats page
+#include <linux/pid.h>
+#include <linux/pid_namespace.h> // init_pid_ns, the registry holds global pids
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
 #include "scull.h"		/* local definitions */
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"	/* tracepoints */
+
 #include <linux/sched.h>
+#include <linux/sched/signal.h> // for_each_thread
 #include <linux/smp.h>
 
 /*
@@ -41,11 +51,33 @@
 static int scull_major =   SCULL_MAJOR;
 static int scull_minor =   0;
 static int scull_quantum = SCULL_QUANTUM;
+static unsigned int scull_stats_ms = 10; // how often the stats page is refreshed
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 
+/* 0 would have the stats work requeue itself back to back, holding mux */
+static int scull_stats_ms_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int ms;
+	int ret = kstrtouint(val, 0, &ms);
+
+	if (ret)
+		return ret;
+	if (ms == 0)
+		return -EINVAL;
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops scull_stats_ms_ops = {
+	.set = scull_stats_ms_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(scull_stats_ms, &scull_stats_ms_ops, &scull_stats_ms, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scull_stats_ms, "milliseconds between stats page updates");
+
 MODULE_AUTHOR("jknuckle"); //my uname
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -54,9 +86,18 @@ MODULE_LICENSE("Dual BSD/GPL");
 //init mutex
 static DEFINE_MUTEX(mux); 
 
-// getting task struct
-task_info tinfo;
-task_info user_tinfo;
+/*
+ * Per open file, in filp->private_data: scratch space for the ioctls
+ * that need some, so separate opens never share it. Threads sharing
+ * one fd do share it, hence the lock; it is never held with mux
+ * across anything but add_node().
+ */
+struct scull_file {
+	struct mutex lock;	// everything below
+	task_info tinfo;	// IQUANTUM
+	task_info* tg_buf;	// XTGROUP, allocated on first use, grown as needed
+	unsigned int tg_max;	// entries tg_buf has room for
+};
 
 //sets up the task struct with the proper values
 void init_task_info(task_info* tinfo) {
@@ -69,37 +110,347 @@ void init_task_info(task_info* tinfo) {
 	tinfo->nivcsw = current->nivcsw;
 }
 
-//adding node to LL
+//same thing for a task that may not be current
+static void fill_task_info(task_info* tinfo, struct task_struct* t) {
+	tinfo->__state = READ_ONCE(t->__state);
+	tinfo->cpu = task_cpu(t);
+	tinfo->prio = t->prio;
+	tinfo->pid = t->pid;
+	tinfo->tgid = t->tgid;
+	tinfo->nvcsw = t->nvcsw;
+	tinfo->nivcsw = t->nivcsw;
+}
+
+/*
+ * The stats page (see scull.h). One page for the whole module, mapped
+ * read-only by whoever wants it; stats_pid[] says which thread owns
+ * each slot. Both are changed under mux, and the refresh work takes
+ * mux too, so a slot only ever has one writer.
+ */
+static struct scull_stats_page *stats_page;
+static struct pid *stats_pid[SCULL_STATS_SLOTS];
+static void scull_stats_update(struct work_struct *work);
+static DECLARE_DELAYED_WORK(stats_work, scull_stats_update);
+
+//rewrite slot i from t (NULL clears it), seq odd while we do
+static void scull_stats_publish(int i, struct task_struct* t) {
+	struct scull_stats_slot *slot = &stats_page->slot[i];
+	unsigned int seq = slot->seq;
+
+	WRITE_ONCE(slot->seq, seq + 1);
+	smp_wmb(); // seq goes odd before the fields change
+	if (t)
+		fill_task_info(&slot->info, t);
+	else
+		memset(&slot->info, 0, sizeof(slot->info));
+	slot->stamp = ktime_get_ns();
+	smp_wmb(); // and the fields are done before it goes even
+	WRITE_ONCE(slot->seq, seq + 2);
+}
+
+static void scull_stats_update(struct work_struct *work) {
+	struct task_struct* t;
+	int i, live = 0;
+
+	mutex_lock(&mux);
+	for (i = 0; i < SCULL_STATS_SLOTS; i++) {
+		if (stats_pid[i] == NULL)
+			continue;
+		rcu_read_lock();
+		t = pid_task(stats_pid[i], PIDTYPE_PID);
+		if (t)
+			scull_stats_publish(i, t);
+		rcu_read_unlock();
+		if (t) {
+			live++;
+		} else { // thread is gone, free its slot
+			put_pid(stats_pid[i]);
+			stats_pid[i] = NULL;
+			scull_stats_publish(i, NULL);
+		}
+	}
+	if (live) // otherwise stop until somebody registers again
+		schedule_delayed_work(&stats_work, msecs_to_jiffies(scull_stats_ms));
+	mutex_unlock(&mux);
+}
+
+// io_uring's inline attempt mustn't sleep on a lock, it gets punted to a worker instead
+static int scull_lock(struct mutex* m, bool nowait) {
+	if (!nowait) {
+		mutex_lock(m);
+		return 0;
+	}
+	return mutex_trylock(m) ? 0 : -EAGAIN;
+}
+
+//find or hand out the caller's slot
+static int scull_stats_register(bool nowait) {
+	struct pid *pid = task_pid(current);
+	int i, free = -1;
+
+	if (scull_lock(&mux, nowait))
+		return -EAGAIN;
+	for (i = 0; i < SCULL_STATS_SLOTS; i++) {
+		if (stats_pid[i] == pid)
+			break;
+		if (stats_pid[i] == NULL && free < 0)
+			free = i;
+	}
+	if (i == SCULL_STATS_SLOTS) {
+		if (free < 0) {
+			mutex_unlock(&mux);
+			return -ENOSPC;
+		}
+		i = free;
+		stats_pid[i] = get_pid(pid);
+	}
+	scull_stats_publish(i, current); // valid as soon as we return
+	schedule_delayed_work(&stats_work, msecs_to_jiffies(scull_stats_ms));
+	mutex_unlock(&mux);
+	return i;
+}
+
+//unlink n from the ll
+static void ll_unlink(LL* pll, node* n) {
+	if (n->prev)
+		n->prev->next = n->next;
+	else
+		pll->head = n->next;
+	if (n->next)
+		n->next->prev = n->prev;
+	else
+		pll->tail = n->prev;
+}
+
+//stamp n with the next generation and put it at the tail, keeps the ll in gen order
+static void ll_touch(LL* pll, node* n) {
+	if (pll->tail != n) {
+		ll_unlink(pll, n);
+		n->prev = pll->tail;
+		n->next = NULL;
+		if (pll->tail)
+			pll->tail->next = n;
+		else
+			pll->head = n;
+		pll->tail = n;
+	}
+	n->gen = ++pll->gen;
+}
+
+static unsigned int scull_reap_ms = 1000; // how often we look for exited tasks
+module_param(scull_reap_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scull_reap_ms, "milliseconds between scans for exited registry tasks");
+
+// the reaper only runs while somebody registered is alive, add_node() starts it again
+static void scull_reg_reap(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reg_work, scull_reg_reap);
+
+//adding node to LL, or updating it if the pid is already there
 void add_node(task_info tinfo, LL* pll, int* retval) {
-	int j = tinfo.pid; //for checking for duplicates
 	node* temp; //for traversing through the linked list
-	node* insert = (node*) kmalloc(sizeof(node), GFP_KERNEL); //node ptr that will actually be inserted to ll
+	node* insert; //node ptr that will actually be inserted to ll
+
+	for (temp = pll->head; temp != NULL; temp = temp->next) {
+		if (temp->pid == tinfo.pid) { // already registered, it's an update
+			if (temp->removed) { // pid got reused after the old task went
+				temp->removed = 0;
+				pll->tombs--;
+			}
+			temp->tgid = tinfo.tgid;
+			temp->info = tinfo;
+			ll_touch(pll, temp);
+			schedule_delayed_work(&reg_work, msecs_to_jiffies(scull_reap_ms)); // no-op if it's pending
+			return;
+		}
+	}
+
+	insert = (node*) kmalloc(sizeof(node), GFP_KERNEL);
 	if (insert == NULL) { // checks kmalloc error
-		*retval = -1;
+		*retval = -ENOMEM;
+		return;
 	}
 	insert->pid = tinfo.pid; // fills node pointed to by insert with proper values
 	insert->tgid = tinfo.tgid;
+	insert->info = tinfo;
+	insert->removed = 0;
 	insert->next = NULL;
-	temp = pll->head; // start ll traversal
-	if (temp == NULL) { //insert insert as head if head is null
+	insert->prev = pll->tail;
+	if (pll->tail)
+		pll->tail->next = insert;
+	else
 		pll->head = insert;
-		return;
-	}
-	else { // if head isn't null
-		while (temp->next != NULL) {
-			if (temp->pid == j) { // if curr process's pid is a duplicate
-				kfree(insert); // gotta free insert sisnce it won't be inserted into ll
-				return;
+	pll->tail = insert;
+	insert->gen = ++pll->gen;
+	schedule_delayed_work(&reg_work, msecs_to_jiffies(scull_reap_ms));
+}
+
+/*
+ * Tombstones: when a registered task exits its node stays on the list,
+ * marked removed, so a delta can say so. We keep at most this many; the
+ * oldest go first, and whoever asks for a delta from before them gets
+ * SCULL_REG_FULL instead.
+ */
+#define SCULL_REG_TOMBS_MAX 1024
+
+static void scull_reg_reap(struct work_struct *work) {
+	node* temp;
+	node* next;
+	node* end;
+	bool alive, last, live = false;
+
+	mutex_lock(&mux);
+	end = pll->tail; // the ones we move go after it, don't look at them twice
+	for (temp = pll->head; temp != NULL; temp = next) {
+		next = temp->next;
+		last = (temp == end);
+		if (!temp->removed) {
+			struct task_struct* t;
+
+			rcu_read_lock();
+			t = pid_task(find_pid_ns(temp->pid, &init_pid_ns), PIDTYPE_PID);
+			alive = t && t->tgid == temp->tgid;
+			rcu_read_unlock();
+			if (!alive) {
+				temp->removed = 1;
+				pll->tombs++;
+				ll_touch(pll, temp);
 			}
-			temp = temp->next; // traverse through the list
+			live |= alive;
 		}
-		if (temp->pid == j) { // free insert if it is a duplicate pid
-			kfree(insert);
-			return;
+		if (last)
+			break;
+	}
+	//forget the oldest tombstones, they're nearest the head
+	for (temp = pll->head; temp != NULL && pll->tombs > SCULL_REG_TOMBS_MAX; temp = next) {
+		next = temp->next;
+		if (!temp->removed)
+			continue;
+		pll->horizon = temp->gen;
+		pll->tombs--;
+		ll_unlink(pll, temp);
+		kfree(temp);
+	}
+	mutex_unlock(&mux);
+
+	if (live) // nobody left to watch otherwise, the next add_node() starts us again
+		schedule_delayed_work(&reg_work, msecs_to_jiffies(scull_reap_ms));
+}
+
+/*
+ * SCULL_IOCXREGDELTA. The list is in gen order, so we walk back from the
+ * tail only as far as since: the cost follows how much changed, not how
+ * big the registry is.
+ */
+static int scull_reg_delta(struct scull_reg_delta __user *uarg) {
+	struct scull_reg_delta d;
+	struct scull_reg_entry e;
+	struct scull_reg_entry __user *out;
+	node* temp;
+	int retval = 0;
+
+	if (copy_from_user(&d, uarg, sizeof(d)))
+		return -EFAULT;
+	out = u64_to_user_ptr(d.entries);
+	d.count = 0;
+	d.flags = 0;
+	memset(&e, 0, sizeof(e));
+
+	mutex_lock(&mux);
+	if (d.since < pll->horizon || d.since > pll->gen) { // we've forgotten removals they haven't seen, or it's from before a reload
+		d.flags |= SCULL_REG_FULL;
+		temp = pll->head;
+	} else {
+		for (temp = pll->tail; temp != NULL && temp->prev != NULL && temp->prev->gen > d.since; temp = temp->prev)
+			;
+		if (temp != NULL && temp->gen <= d.since)
+			temp = NULL; // nothing new
+	}
+	d.gen = (d.flags & SCULL_REG_FULL) ? 0 : d.since;
+	for (; temp != NULL && d.count < d.max; temp = temp->next) {
+		if ((d.flags & SCULL_REG_FULL) && temp->removed)
+			continue;
+		e.gen = temp->gen;
+		e.info = temp->info;
+		e.flags = temp->removed ? SCULL_REG_REMOVED : 0;
+		if (copy_to_user(&out[d.count], &e, sizeof(e))) {
+			retval = -EFAULT;
+			break;
 		}
-		temp->next = insert; //place insert into the ll appropriately
-		return;
+		d.count++;
+		d.gen = temp->gen;
 	}
+	if (temp != NULL)
+		d.flags |= SCULL_REG_MORE;
+	else if (retval == 0)
+		d.gen = pll->gen; // caught up
+	mutex_unlock(&mux);
+
+	if (retval == 0 && copy_to_user(uarg, &d, sizeof(d)))
+		retval = -EFAULT;
+	return retval;
+}
+
+/*
+ * SCULL_IOCXTGROUP. The thread list is walked under RCU, where we can't
+ * touch user memory or allocate, so it goes through the fd's buffer
+ * first. That one is sized by the threads counted on the way, capped at
+ * max; if it was too small we grow it and walk again.
+ */
+static int scull_tgroup(struct scull_file *sf, struct scull_tgroup __user *uarg) {
+	struct scull_tgroup g;
+	struct task_struct* p;
+	struct task_struct* t;
+	task_info* buf;
+	unsigned int n, max, want;
+	int retval = 0;
+
+	if (copy_from_user(&g, uarg, sizeof(g)))
+		return -EFAULT;
+	max = min_t(unsigned int, g.max, SCULL_TGROUP_MAX);
+
+	mutex_lock(&sf->lock);
+	for (;;) {
+		rcu_read_lock();
+		if (g.tgid)
+			p = pid_task(find_vpid(g.tgid), PIDTYPE_TGID);
+		else
+			p = current;
+		if (p == NULL) {
+			rcu_read_unlock();
+			mutex_unlock(&sf->lock);
+			return -ESRCH;
+		}
+		n = 0;
+		for_each_thread(p, t) {
+			if (n < max && n < sf->tg_max)
+				fill_task_info(&sf->tg_buf[n], t);
+			n++; // keep counting, that's the size they need
+		}
+		rcu_read_unlock();
+
+		want = min(n, max);
+		if (want <= sf->tg_max)
+			break; // got all we can hand back
+		// size the fd's buffer to the threads there are, not to max, and look again
+		buf = kvmalloc_array(want, sizeof(*buf), GFP_KERNEL);
+		if (buf == NULL) {
+			mutex_unlock(&sf->lock);
+			return -ENOMEM;
+		}
+		kvfree(sf->tg_buf);
+		sf->tg_buf = buf;
+		sf->tg_max = want;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(g.infos), sf->tg_buf, want * sizeof(*sf->tg_buf)))
+		retval = -EFAULT;
+	g.count = n;
+	if (retval == 0 && copy_to_user(uarg, &g, sizeof(g)))
+		retval = -EFAULT;
+	if (retval == 0 && n > max)
+		retval = -ENOSPC;
+	mutex_unlock(&sf->lock);
+	return retval;
 }
 
 //destory LL
@@ -123,9 +474,11 @@ void print_ll(LL* pll) {
 	}
 	else { //if head is not null
 		while (temp != NULL) { //print the info of the nodes until it is null
-			printk("Task %d: PID %d, TGID %d\n", i+1, temp->pid, temp->tgid);
+			if (!temp->removed) { // tombstones are gone already
+				printk("Task %d: PID %d, TGID %d\n", i+1, temp->pid, temp->tgid);
+				i++;
+			}
 			temp = temp->next;
-			i++;
 		}
 		return;
 	}
@@ -139,22 +492,46 @@ static struct cdev scull_cdev;		/* Char device structure */
 
 static int scull_open(struct inode *inode, struct file *filp)
 {
+	struct scull_file *sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+
+	if (sf == NULL)
+		return -ENOMEM;
+	mutex_init(&sf->lock);
+	filp->private_data = sf;
 	printk(KERN_INFO "scull open\n");
 	return 0;          /* success */
 }
 
 static int scull_release(struct inode *inode, struct file *filp)
 {
+	struct scull_file *sf = filp->private_data;
+
+	kvfree(sf->tg_buf);
+	kfree(sf);
 	printk(KERN_INFO "scull close\n");
 	return 0;
 }
 
+/*
+ * mmap: the stats page, read-only, the whole of it at offset 0
+ */
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE); // no mprotect() to writable later
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(stats_page));
+}
+
 /*
  * The ioctl() implementation
  */
 
-static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long scull_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg, bool nowait)
 {	
+	struct scull_file *sf = filp->private_data;
 	int err = 0, tmp;
 	int retval = 0;
     
@@ -202,24 +579,76 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return tmp;
 
 	case SCULL_IOCIQUANTUM: // case for when SCULL_IOCIQUANTUM is called.
-		mutex_lock(&mux); //manage concurrency
-		init_task_info(&tinfo); //fill info_struct with values
-		if (copy_to_user((task_info __user *)arg, &tinfo, sizeof(tinfo)) != 0) { //check for error
-			retval = -1;
+		if (scull_lock(&sf->lock, nowait)) //only threads on this fd wait here
+			return -EAGAIN;
+		if (scull_lock(&mux, nowait)) { //the registry is still shared; nothing done yet, so a retry is fine
+			mutex_unlock(&sf->lock);
+			return -EAGAIN;
 		}
-		add_node(tinfo, pll, &retval); //add to ll
+		init_task_info(&sf->tinfo); //fill info_struct with values
+		trace_scull_task_info(&sf->tinfo);
+		add_node(sf->tinfo, pll, &retval); //add to ll
 		mutex_unlock(&mux); //unlock
+		if (copy_to_user((task_info __user *)arg, &sf->tinfo, sizeof(sf->tinfo)) != 0) { //check for error
+			retval = -1;
+		}
+		mutex_unlock(&sf->lock);
 		break;
 
+	case SCULL_IOCQSTATS: /* Query: the caller's slot in the stats page */
+		return scull_stats_register(nowait);
+
+	case SCULL_IOCXREGDELTA: /* eXchange: since in, changes and new gen out */
+		return scull_reg_delta((struct scull_reg_delta __user *)arg);
+
+	case SCULL_IOCXTGROUP: /* eXchange: tgid in, its threads out */
+		return scull_tgroup(sf, (struct scull_tgroup __user *)arg);
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
 	return retval;
 }
 
+static long scull_trace_ioctl(struct file *filp, unsigned int cmd, unsigned long arg, bool nowait)
+{
+	long ret = scull_do_ioctl(filp, cmd, arg, nowait);
+
+	trace_scull_ioctl(cmd, arg, ret);
+	return ret;
+}
+
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return scull_trace_ioctl(filp, cmd, arg, false);
+}
+
+/*
+ * io_uring: IORING_OP_URING_CMD runs the ioctl in cmd_op with the
+ * argument from the SQE, so user space can queue a batch of them behind
+ * one io_uring_enter(). IQUANTUM and QSTATS describe the caller, so they
+ * have to run inline, in the submitting thread: they only try their
+ * mutexes there and return EAGAIN, which punts them to an io_uring
+ * worker, when one is taken. Then (and under SQPOLL) task_info and the
+ * stats slot describe that worker instead. XREGDELTA takes the mutex
+ * and XTGROUP may allocate, and neither cares who asks, so those are
+ * always punted.
+ */
+static int scull_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	const struct scull_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+	bool nowait = issue_flags & IO_URING_F_NONBLOCK;
+
+	if (nowait && (ioucmd->cmd_op == SCULL_IOCXREGDELTA || ioucmd->cmd_op == SCULL_IOCXTGROUP))
+		return -EAGAIN;
+	return scull_trace_ioctl(ioucmd->file, ioucmd->cmd_op, READ_ONCE(cmd->arg), nowait);
+}
+
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.unlocked_ioctl = scull_ioctl,
+	.uring_cmd = scull_uring_cmd,
+	.mmap =     scull_mmap,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -237,13 +666,28 @@ void scull_cleanup_module(void)
 {
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	int i;
+
 	/* Get rid of the char dev entry */
 	cdev_del(&scull_cdev);
 
+	//stop refreshing the stats page before it goes; it takes mux itself
+	cancel_delayed_work_sync(&stats_work);
+	cancel_delayed_work_sync(&reg_work); // same for the reaper and pll
+	for (i = 0; i < SCULL_STATS_SLOTS; i++) {
+		put_pid(stats_pid[i]);
+		stats_pid[i] = NULL;
+	}
+	free_page((unsigned long)stats_page); // a process can still have it mapped, the page holds its own ref
+	stats_page = NULL;
+
 	//destroy pll
 	mutex_lock(&mux); //lock for printing and destroying ll
-	print_ll(pll); //print ll
-	destroy_LL(pll); //destory ll
+	if (pll) { // not there if init failed early
+		print_ll(pll); //print ll
+		destroy_LL(pll); //destory ll
+		pll = NULL;
+	}
 	mutex_unlock(&mux); //unlock
 
 	/* cleanup_module is never called if registering failed */
@@ -271,21 +715,29 @@ int scull_init_module(void)
 		return result;
 	}
 
-	cdev_init(&scull_cdev, &scull_fops);
+	cdev_init(&scull_cdev, &scull_fops); // so the cleanup can cdev_del() it whatever happens next
 	scull_cdev.owner = THIS_MODULE;
+
+	//everything the fops use has to be there before cdev_add() makes the device live
+	pll = (LL*)kzalloc(sizeof(LL), GFP_KERNEL); //allocate ll on startup, empty and at gen 0
+	if (pll == NULL) { //check kmalloc error
+		result = -ENOMEM;
+		goto fail;
+	}
+
+	BUILD_BUG_ON(sizeof(struct scull_stats_page) > PAGE_SIZE);
+	stats_page = (struct scull_stats_page *)get_zeroed_page(GFP_KERNEL);
+	if (stats_page == NULL) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
 	result = cdev_add (&scull_cdev, dev, 1);
 	/* Fail gracefully if need be */
 	if (result) {
 		printk(KERN_NOTICE "Error %d adding scull character device", result);
 		goto fail;
 	}
-	//initialize linked list
-	pll = (LL*)kmalloc(sizeof(LL*), GFP_KERNEL); //allocate ll on startup
-	if (pll == NULL) { //check kmalloc error
-		goto fail;
-	}
-	pll->head = NULL; //set head to NULL
-	
 
 	return 0; /* succeed */
 
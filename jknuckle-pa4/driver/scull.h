@@ -54,19 +54,115 @@ typedef struct {
 	unsigned long nivcsw; // Number of involuntary context switches
 } task_info;
 
+/*
+ * The stats page: mmap() PAGE_SIZE bytes at offset 0 of the device,
+ * read-only, and SCULL_IOCQSTATS registers the calling thread in a
+ * slot. The module rewrites every registered slot each scull_stats_ms
+ * milliseconds, so a thread reads its own task_info with plain loads
+ * instead of an ioctl. seq is odd while a slot is being written;
+ * scull_stats_read() retries until it sees the same even value on
+ * both sides. A slot whose pid is 0 is free (its thread exited).
+ */
+#define SCULL_STATS_SLOTS 64
+
+struct scull_stats_slot {
+	unsigned int seq;
+	unsigned int pad;
+	unsigned long long stamp; // CLOCK_MONOTONIC ns of the last update
+	task_info info;
+};
+
+struct scull_stats_page {
+	struct scull_stats_slot slot[SCULL_STATS_SLOTS];
+};
+
+#ifndef __KERNEL__
+static inline void scull_stats_read(const struct scull_stats_slot *s, task_info *info,
+				    unsigned long long *stamp)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		*info = s->info;
+		if (stamp)
+			*stamp = s->stamp;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+}
+#endif
+
 //defining linked list
 typedef struct node node;
 struct node {
 	pid_t pid;
 	pid_t tgid;
+	unsigned long long gen; // registry generation of the last change to this entry
+	int removed; // tombstone: the task exited, kept so deltas can report it
+	task_info info; // as of its last SCULL_IOCIQUANTUM
 	node* next;
+	node* prev;
 };
 
-//linked list struct
+//linked list struct, kept in gen order: every change moves a node to the tail
 typedef struct {
 	node* head;
+	node* tail;
+	unsigned long long gen; // bumped by every add, update and removal
+	unsigned long long horizon; // newest tombstone thrown away, older deltas need a full resync
+	unsigned int tombs; // tombstones still on the list
 } LL;
 
+/*
+ * SCULL_IOCXREGDELTA: the registry entries added, updated or removed
+ * after generation since, oldest first, up to max of them into the
+ * user array at entries. gen comes back as the since to pass next
+ * time. SCULL_REG_FULL means removals older than since were forgotten,
+ * or since is newer than anything here (the module was reloaded):
+ * throw away what you have, this is the whole registry again (live
+ * entries only). SCULL_REG_MORE means entries didn't hold it all; call
+ * again with the new since. since 0 always gets the lot.
+ */
+struct scull_reg_entry {
+	unsigned long long gen;
+	task_info info;
+	unsigned int flags; // SCULL_REG_REMOVED
+	unsigned int pad;
+};
+
+#define SCULL_REG_REMOVED 0x1
+
+struct scull_reg_delta {
+	unsigned long long since; // in
+	unsigned long long entries; // in: struct scull_reg_entry *
+	unsigned int max; // in
+	unsigned int count; // out: entries filled in
+	unsigned long long gen; // out
+	unsigned int flags; // out: SCULL_REG_FULL, SCULL_REG_MORE
+	unsigned int pad;
+};
+
+#define SCULL_REG_FULL 0x1
+#define SCULL_REG_MORE 0x2
+
+/*
+ * SCULL_IOCXTGROUP: task_info for every thread of thread group tgid
+ * (0 for the caller's own) in one call, into the user array at infos
+ * with room for max of them. count comes back as the number of threads;
+ * if that's more than max, the first max are filled in and the ioctl
+ * fails with ENOSPC, so size the array to count and ask again.
+ */
+struct scull_tgroup {
+	int tgid; // in
+	unsigned int max; // in
+	unsigned long long infos; // in: task_info *
+	unsigned int count; // out
+	unsigned int pad;
+};
+
+#define SCULL_TGROUP_MAX 65536 // most we'll snapshot in one go
+
 //init global linked list
 LL* pll;
 
@@ -87,8 +183,19 @@ LL* pll;
 #define SCULL_IOCXQUANTUM _IOWR(SCULL_IOC_MAGIC, 5, int)
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC,   6)
 #define SCULL_IOCIQUANTUM _IOR(SCULL_IOC_MAGIC, 7, task_info) //defining SCULL_IOCIQUANTUM syscall
+#define SCULL_IOCQSTATS   _IO(SCULL_IOC_MAGIC,   8) // register the caller, return its stats page slot
+#define SCULL_IOCXREGDELTA _IOWR(SCULL_IOC_MAGIC, 9, struct scull_reg_delta) // registry changes since a generation
+#define SCULL_IOCXTGROUP  _IOWR(SCULL_IOC_MAGIC, 10, struct scull_tgroup) // every thread of a process
+
+/*
+ * IORING_OP_URING_CMD: cmd_op is one of the above, the SQE's cmd area
+ * holds the ioctl argument
+ */
+struct scull_uring_cmd {
+	unsigned long long arg;
+};
 
 /* Do not forget to modify this macro if you add new commands! */
-#define SCULL_IOC_MAXNR 7
+#define SCULL_IOC_MAXNR 10
 
 #endif /* _SCULL_H_ */
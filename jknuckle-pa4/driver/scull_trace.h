@@ -0,0 +1,79 @@
+/*
+ * scull_trace.h -- tracepoints for the scull task_info device
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/scull/enable
+ * or
+ *   perf trace -e 'scull:*'
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(scull_ioctl,
+
+	TP_PROTO(unsigned int cmd, unsigned long arg, long ret),
+
+	TP_ARGS(cmd, arg, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cmd)
+		__field(unsigned long,	arg)
+		__field(long,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->cmd	= cmd;
+		__entry->arg	= arg;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("nr=%u arg=0x%lx ret=%ld",
+		  _IOC_NR(__entry->cmd), __entry->arg, __entry->ret)
+);
+
+/* SCULL_IOCIQUANTUM filled in a task_info */
+TRACE_EVENT(scull_task_info,
+
+	TP_PROTO(const task_info *ti),
+
+	TP_ARGS(ti),
+
+	TP_STRUCT__entry(
+		__field(pid_t,		pid)
+		__field(pid_t,		tgid)
+		__field(unsigned int,	cpu)
+		__field(int,		prio)
+		__field(unsigned int,	state)
+		__field(unsigned long,	nvcsw)
+		__field(unsigned long,	nivcsw)
+	),
+
+	TP_fast_assign(
+		__entry->pid	= ti->pid;
+		__entry->tgid	= ti->tgid;
+		__entry->cpu	= ti->cpu;
+		__entry->prio	= ti->prio;
+		__entry->state	= ti->__state;
+		__entry->nvcsw	= ti->nvcsw;
+		__entry->nivcsw	= ti->nivcsw;
+	),
+
+	TP_printk("pid=%d tgid=%d cpu=%u prio=%d state=%u nv=%lu niv=%lu",
+		  __entry->pid, __entry->tgid, __entry->cpu, __entry->prio,
+		  __entry->state, __entry->nvcsw, __entry->nivcsw)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
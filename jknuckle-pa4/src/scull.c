@@ -11,6 +11,7 @@
 #include <semaphore.h>
 #include <sched.h>
 #include <time.h>
+#include <sys/mman.h>
 
 
 #include "scull.h"
@@ -19,6 +20,10 @@
 
 /* Quantum command line option */
 static int g_quantum;
+/* Generation for the 'd' command */
+static unsigned long long g_since;
+/* Thread group for the 'g' command, 0 = our own */
+static int g_tgid;
 
 //my function that prints the output for the "i" argument
 void print_task_info(task_info tinfo) {
@@ -41,6 +46,94 @@ void* t_function(void* fd) {
 	pthread_exit(NULL);
 }
 
+//'m': register for the stats page and read it a few times, no ioctl per read
+static int do_stats(int fd) {
+	const struct scull_stats_page *page;
+	task_info tinfo;
+	unsigned long long stamp;
+	int slot, i;
+
+	slot = ioctl(fd, SCULL_IOCQSTATS);
+	if (slot < 0)
+		return -1;
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		return -1;
+
+	for (i = 0; i < 3; i++) {
+		scull_stats_read(&page->slot[slot], &tinfo, &stamp);
+		printf("slot %d @%llu: ", slot, stamp);
+		print_task_info(tinfo);
+		sleep(1); // plenty of refreshes in between, and a voluntary switch
+	}
+
+	munmap((void *)page, sizeof(*page));
+	return 0;
+}
+
+//'d': registry changes since a generation, a page at a time
+static int do_delta(int fd, unsigned long long since) {
+	struct scull_reg_entry e[16];
+	struct scull_reg_delta d;
+	unsigned int i;
+
+	d.since = since;
+	do {
+		d.entries = (unsigned long)e;
+		d.max = sizeof(e) / sizeof(e[0]);
+		if (ioctl(fd, SCULL_IOCXREGDELTA, &d) < 0)
+			return -1;
+		if (d.flags & SCULL_REG_FULL)
+			printf("full resync\n");
+		for (i = 0; i < d.count; i++) {
+			printf("%c gen %llu: ", (e[i].flags & SCULL_REG_REMOVED) ? '-' : '+', e[i].gen);
+			print_task_info(e[i].info);
+		}
+		d.since = d.gen;
+	} while (d.flags & SCULL_REG_MORE);
+
+	printf("Generation: %llu\n", d.gen);
+	return 0;
+}
+
+//'g': every thread of a process in one call, growing the array if the kernel says so
+static int do_tgroup(int fd, int tgid) {
+	struct scull_tgroup g;
+	task_info *infos = NULL, *tmp;
+	unsigned int i, max = 16;
+	int ret;
+
+	for (;;) {
+		tmp = realloc(infos, max * sizeof(*infos));
+		if (tmp == NULL) {
+			free(infos);
+			return -1;
+		}
+		infos = tmp;
+		g.tgid = tgid;
+		g.max = max;
+		g.infos = (unsigned long)infos;
+		ret = ioctl(fd, SCULL_IOCXTGROUP, &g);
+		if (ret == 0 || errno != ENOSPC)
+			break;
+		if (max >= SCULL_TGROUP_MAX) { // the most it hands out, take what we got
+			ret = 0;
+			break;
+		}
+		max = g.count < SCULL_TGROUP_MAX ? g.count : SCULL_TGROUP_MAX; // threads may come and go meanwhile
+	}
+	if (ret == 0) {
+		printf("%u thread(s)", g.count);
+		if (g.count > max)
+			printf(", the first %u", max);
+		printf("\n");
+		for (i = 0; i < g.count && i < max; i++)
+			print_task_info(infos[i]);
+	}
+	free(infos);
+	return ret;
+}
+
 static void usage(const char *cmd)
 {
 	printf("Usage: %s <command>\n"
@@ -52,6 +145,9 @@ static void usage(const char *cmd)
 	       "  Q          Query quantum\n"
 	       "  X <int>    Exchange quantum\n"
 	       "  H <int>    Shift quantum\n"
+	       "  m          Read own task info from the mmap'd stats page\n"
+	       "  d [gen]    Registry changes since generation gen (default 0)\n"
+	       "  g [tgid]   Task info for every thread of tgid (default this process)\n"
 	       "  h          Print this message\n",
 	       cmd);
 }
@@ -82,6 +178,14 @@ static cmd_t parse_arguments(int argc, const char **argv)
 		}
 		g_quantum = atoi(argv[2]);
 		break;
+	case 'd':
+		if (argc >= 3)
+			g_since = strtoull(argv[2], NULL, 10);
+		break;
+	case 'g':
+		if (argc >= 3)
+			g_tgid = atoi(argv[2]);
+		break;
 	case 'R':
 	case 'G':
 	case 'Q':
@@ -89,6 +193,7 @@ static cmd_t parse_arguments(int argc, const char **argv)
 	case 'i': //include this and two lines below so that invalid command message won't be shown
 	case 'p':
 	case 't':
+	case 'm':
 		break;
 	default:
 		fprintf(stderr, "%s: Invalid command\n", argv[0]);
@@ -198,6 +303,15 @@ static int do_op(int fd, cmd_t cmd)
 		}
 		ret = 0; // break with no error.
 		break;
+	case 'm':
+		ret = do_stats(fd);
+		break;
+	case 'd':
+		ret = do_delta(fd, g_since);
+		break;
+	case 'g':
+		ret = do_tgroup(fd, g_tgid);
+		break;
 	default:
 		/* Should never occur */
 		abort();
@@ -24,135 +24,2340 @@
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/cdev.h>
-#include <linux/mutex.h> //for the mutex
-#include <linux/semaphore.h> //for the semaphore
+#include <linux/wait.h> //for the wait queues
+#include <linux/sched.h> //need_resched()
 #include <linux/errno.h> //for the error returns
+#include <linux/ktime.h> //for the enqueue timestamps
+#include <linux/percpu.h> //for the per-cpu latency histogram
+#include <linux/debugfs.h> //for exporting the histogram
+#include <linux/seq_file.h>
+#include <linux/mm.h> //pin_user_pages_fast()
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/llist.h> //zero-copy messages to free later
+#include <linux/uio.h> //iov_iter
+#include <linux/poll.h>
+#include <linux/io_uring/cmd.h> //uring_cmd
+#include <linux/mutex.h>
+#include <linux/workqueue.h> //replaying the spill
+#include <linux/file.h> //fput()
+#include <linux/bitops.h> //group masks
+#include <linux/eventfd.h> //watermark notifications
+#include <linux/jump_label.h> //static key for power-of-two rings
+#include <linux/log2.h>
+#include <linux/capability.h> //raising a quota
+#include <linux/overflow.h> //check_mul_overflow()
 
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
 #include "scull.h"		/* local definitions */
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"	/* tracepoints */
+
+/*
+ * Our parameters which can be set at load time.
+ */
+
+static int scull_major =   SCULL_MAJOR;
+static int scull_minor =   0;
+/*
+ * Ring geometry can be fixed at build time (see the Makefile):
+ * SCULL_FIFO_SIZE_FIXED, a power of two, and SCULL_FIFO_ELEMSZ_FIXED
+ * make the slot count and the slot stride constants, so indexing is a
+ * mask and the stride a constant multiply. The module parameters then
+ * default to those values and may not be set to anything else.
+ */
+#ifdef SCULL_FIFO_SIZE_FIXED
+static_assert(SCULL_FIFO_SIZE_FIXED > 0 && (SCULL_FIFO_SIZE_FIXED & (SCULL_FIFO_SIZE_FIXED - 1)) == 0,
+	      "SCULL_FIFO_SIZE_FIXED must be a power of two");
+#define SCULL_FIFO_SIZE_INIT SCULL_FIFO_SIZE_FIXED
+#else
+#define SCULL_FIFO_SIZE_INIT SCULL_FIFO_SIZE_DEFAULT
+#endif
+#ifdef SCULL_FIFO_ELEMSZ_FIXED
+static_assert(SCULL_FIFO_ELEMSZ_FIXED > 0, "SCULL_FIFO_ELEMSZ_FIXED must be positive");
+#define SCULL_FIFO_ELEMSZ_INIT SCULL_FIFO_ELEMSZ_FIXED
+#else
+#define SCULL_FIFO_ELEMSZ_INIT SCULL_FIFO_ELEMSZ_DEFAULT
+#endif
+
+static int scull_fifo_elemsz = SCULL_FIFO_ELEMSZ_INIT; /* ELEMSZ */
+static int scull_fifo_size   = SCULL_FIFO_SIZE_INIT;   /* N      */
+static bool scull_fifo_latency = false; /* record the queueing delay */
+static unsigned int scull_spin_max_ns = 0; /* spin before sleeping, 0 = off */
+static int scull_fifo_lanes  = SCULL_FIFO_LANES_DEFAULT;  /* priority lanes */
+static int scull_fifo_maxmsg = 0; /* largest message, 0 = what fits in a lane */
+static int scull_fifo_node = NUMA_NO_NODE; /* NUMA node for the lanes, -1 = any */
+static bool scull_fifo_pernode = false; /* a set of lanes on every node */
+static int scull_nr_nodes = 1; /* sets of lanes, nr_node_ids with scull_fifo_pernode */
+static int scull_fifo_groups = SCULL_FIFO_GROUPS_DEFAULT; /* consumer groups */
+static char *scull_spill_dir = NULL; /* spill overflow to files in here, NULL = block */
+static unsigned long scull_spill_max = 64UL << 20; /* bytes of spill per lane */
+static unsigned long scull_fifo_quota = 0; /* ring bytes one open file may hold, 0 = no limit */
+
+module_param(scull_major, int, S_IRUGO);
+module_param(scull_minor, int, S_IRUGO);
+module_param(scull_fifo_size, int, S_IRUGO);
+module_param(scull_fifo_elemsz, int, S_IRUGO);
+module_param(scull_fifo_latency, bool, S_IRUGO | S_IWUSR);
+module_param(scull_spin_max_ns, uint, S_IRUGO);
+module_param(scull_fifo_lanes, int, S_IRUGO);
+module_param(scull_fifo_maxmsg, int, S_IRUGO);
+module_param(scull_fifo_node, int, S_IRUGO);
+module_param(scull_fifo_pernode, bool, S_IRUGO);
+module_param(scull_fifo_groups, int, S_IRUGO);
+module_param(scull_spill_dir, charp, S_IRUGO);
+module_param(scull_spill_max, ulong, S_IRUGO);
+module_param(scull_fifo_quota, ulong, S_IRUGO | S_IWUSR);
+
+MODULE_AUTHOR("jknuckle");
+MODULE_LICENSE("Dual BSD/GPL");
+
+/*
+ * Every element of the queue starts with this header, followed by
+ * scull_fifo_elemsz bytes of message. A message longer than that
+ * continues in the data area of the next nslots-1 slots; only the
+ * state of those is used, the rest of their header is not.
+ */
+struct scull_hdr {
+	int state;	/* SCULL_SLOT_*, see "Blocking" below */
+	u32 flags;	/* SCULL_HDR_* */
+	u32 nslots;	/* slots the message spans */
+	size_t len;	/* length of the message */
+	u64 seq;	/* lane->seq at enqueue */
+	u64 stamp;	/* ktime_get_ns() at enqueue */
+	u64 deadline;	/* ktime_get_ns() it expires at, 0 = never (TTTL) */
+	pid_t tgid;	/* of the writer */
+	struct scull_producer *prod; /* whose fair share it counts against, or NULL */
+	unsigned long unread;	/* groups that haven't claimed it yet */
+	atomic_t refs;		/* groups that haven't finished with it */
+};
+
+#define SCULL_SLOT_FREE		0	/* empty, writers may claim it */
+#define SCULL_SLOT_WRITING	1	/* claimed by a writer */
+#define SCULL_SLOT_READY	2	/* holds a message, readers may claim it */
+
+#define SCULL_HDR_DEAD		0x1	/* writer faulted, skip the slot */
+#define SCULL_HDR_ZCOPY		0x2	/* data is a struct scull_zc pointer */
+
+/*
+ * Message bytes per slot and slot stride: constants in a fixed
+ * geometry build, else worked out once at load time.
+ */
+#ifdef SCULL_FIFO_ELEMSZ_FIXED
+#define SCULL_ELEMSZ SCULL_FIFO_ELEMSZ_FIXED
+#define SCULL_SLOTSZ ALIGN(sizeof(struct scull_hdr) + SCULL_FIFO_ELEMSZ_FIXED, sizeof(u64))
+#else
+#define SCULL_ELEMSZ ((size_t)scull_fifo_elemsz)
+#define SCULL_SLOTSZ scull_slotsz
+static size_t scull_slotsz __read_mostly;
+#endif
+
+/* a power-of-two scull_fifo_size indexes with a mask even when not fixed */
+static DEFINE_STATIC_KEY_FALSE(scull_fifo_pow2);
+
+/*
+ * Spin-then-sleep state of one side of one open file, see scull_wait().
+ * Per fd rather than per device, so waiters don't all write the same
+ * cache line and a client that always sleeps long doesn't talk the
+ * budget down for one that is always woken quickly.
+ */
+struct scull_spin {
+	unsigned int spin_ns; //current budget, always <= spin_max_ns
+};
+
+/*
+ * Where a consumer group is in a lane, under its group's readq.lock.
+ */
+struct scull_cursor {
+	unsigned int out;		/* next slot to read */
+	unsigned int skipped;		/* passed over for a higher lane */
+	size_t off;			/* bytes of the message at out read in stream mode */
+	bool busy;			/* a stream reader holds the message at out */
+};
+
+/*
+ * One priority lane: a ring of scull_fifo_size slots. The reader and
+ * the writer side each get their own cache line so producers and
+ * consumers don't bounce it between them.
+ */
+struct scull_lane {
+	char *start;			/* the queue, scull_fifo_size slots */
+	struct scull_cursor cur[SCULL_FIFO_GROUPS_MAX]; /* one per consumer group */
+
+	wait_queue_head_t writeq ____cacheline_aligned_in_smp; /* writers waiting for a free slot */
+	unsigned int in;		/* next slot to write, under writeq.lock */
+	u64 seq;			/* sequence number of the next message, ditto */
+	bool spilling;			/* writes go to the spill file, ditto */
+
+	/* overflow, see scull_spill_write() */
+	struct file *spill;		/* NULL without scull_spill_dir */
+	struct mutex spill_lock;	/* the file and both positions */
+	u64 spill_rpos;			/* next record to replay */
+	u64 spill_wpos;			/* where the next one goes, both wrap at scull_spill_max */
+	wait_queue_head_t spillq;	/* writers waiting for room in the file */
+	struct work_struct spill_work;	/* scull_spill_replay() */
+
+	struct delayed_work expire_work; /* scull_expire_sweep() */
+	u64 expire_at;			/* deadline it is armed for, 0 = not armed */
+};
+
+/*
+ * The FIFO device. Lane scull_fifo_lanes-1 has the highest priority.
+ *
+ * The lanes, rings included, are allocated on scull_fifo_node. With
+ * scull_fifo_pernode every NUMA node gets its own set instead: writers
+ * queue to the set on the node they run on and readers look at theirs
+ * first, so a message only crosses sockets when the local set is empty.
+ * Lane l is lane l % scull_fifo_lanes of node l / scull_fifo_lanes.
+ */
+struct scull_group {
+	wait_queue_head_t readq ____cacheline_aligned_in_smp; /* readers waiting for a message */
+	struct list_head retry;		/* uncommitted windows of closed fds, under readq.lock */
+	atomic64_t dropped;		/* messages it lagged too far behind for */
+	atomic64_t expired;		/* messages past their deadline it never read */
+	u64 rr_last;			/* producer it read last, see scull_rr_pick(), under readq.lock */
+};
+
+struct scull_dev {
+	struct scull_lane **node;	/* scull_nr_nodes sets of scull_fifo_lanes lanes */
+	unsigned int spin_max_ns;	/* spin before sleeping, 0 = off */
+	unsigned int fair_limit;	/* see scull_pick_lane(), 0 = strict priority */
+	unsigned long drop_mask;	/* groups that drop rather than block writers */
+	unsigned int share;		/* slots one producer may hold, 0 = no limit */
+	struct cdev cdev;		/* Char device structure */
+	spinlock_t prod_lock;		/* covers prods */
+	struct list_head prods;		/* producers of the open files, for debugfs */
+	atomic_long_t over_quota;	/* writes refused with EDQUOT, all fds ever */
+
+	struct scull_group group[SCULL_FIFO_GROUPS_MAX]; /* scull_fifo_groups of them */
+
+	/* watermarks, see scull_water() */
+	atomic_t used ____cacheline_aligned_in_smp; /* slots not FREE, all lanes */
+	wait_queue_head_t waterq;	/* pollers, its lock covers the rest */
+	unsigned int water_high;	/* 0 = off */
+	unsigned int water_low;
+	bool water_over;		/* reached high, not back to low yet */
+	struct list_head water_fds;	/* scull_files with an eventfd */
+};
+
+static struct scull_dev scull_dev;
+
+/*
+ * Peek mode (TPEEK): a read takes its message for the group as usual,
+ * but the slots are only let go of by TCOMMIT, which takes any number
+ * of messages at once. Until then the message sits in the fd's window.
+ * If the fd is closed first, the window goes on the group's retry list
+ * and the group's readers get those messages again before anything
+ * new, so a consumer that dies between read and commit loses nothing.
+ */
+struct scull_msgref {
+	int lane;
+	unsigned int slot;
+	size_t off;		/* where the read started */
+	bool busy;		/* on a retry list: a stream reader is reading the front of it */
+};
+
+struct scull_peek {
+	struct list_head node;	/* on group->retry once the fd is gone */
+	struct mutex lock;	/* serializes commits */
+	unsigned int head;	/* oldest uncommitted message, ring of SCULL_PEEK_MAX */
+	unsigned int count;	/* messages in the window */
+	struct scull_msgref msg[SCULL_PEEK_MAX];
+};
+
+/*
+ * Fair share (TSHARE): each open file that writes is a producer, and
+ * may have at most dev->share slots of messages queued at once, over
+ * all lanes: a bounded queue depth per producer. One that writes
+ * faster than the readers keep up then waits on its own queue for its
+ * own messages to be read, instead of filling the ring and keeping
+ * everybody else from getting a slot. The ring itself stays in arrival
+ * order, but readers take turns between producers (scull_rr_pick()), so
+ * a backlog of one producer's messages doesn't make everybody else's
+ * wait behind it. A message bigger than the share goes in on its own.
+ * The slots' reference keeps this around after the fd is closed.
+ *
+ * Quota (TQUOTA): the ring bytes (whole slots) its messages may hold.
+ * Unlike the share it is a hard limit, a write that would go over it
+ * fails with EDQUOT straight away, so one tenant can't sit on the ring
+ * memory however slow the readers are. Both are counted while either
+ * is on.
+ */
+struct scull_producer {
+	struct kref ref;		/* the fd's and one per message */
+	atomic_t held;			/* slots its messages occupy, or it has reserved */
+	atomic_long_t bytes;		/* the same, in bytes */
+	unsigned long quota;		/* bytes, 0 = no limit */
+	atomic_long_t over;		/* writes refused for the quota */
+	pid_t tgid;			/* of the opener */
+	u64 id;				/* order of the open, readers take turns by it */
+	struct list_head node;		/* on dev->prods until the fd is closed */
+	wait_queue_head_t waitq;	/* its writers waiting for held to drop */
+};
+
+/*
+ * Private queue (TPRIVATE): a ring only one open file writes and reads,
+ * so none of the FIFO's locks, slots or accounting are touched. Each
+ * message is a struct scull_prec followed by the payload, padded to
+ * SCULL_PREC_ALIGN; the ring size is a multiple of that too, so a
+ * header never wraps around the end. The file allocates it on its first
+ * write in private mode and frees it on close.
+ */
+struct scull_prec {
+	u64 stamp;			/* enqueue time */
+	u32 len;			/* bytes of payload */
+	pid_t tgid;			/* of the writer */
+};
+
+#define SCULL_PREC_ALIGN sizeof(struct scull_prec)
+
+struct scull_privq {
+	struct mutex lock;		/* everything below */
+	char *buf;
+	size_t size;			/* of buf */
+	size_t in, out;			/* offsets of the next write and read */
+	size_t used;			/* bytes between them */
+	u64 seq;			/* messages read, for DRAIN */
+};
+
+/*
+ * Per open file.
+ */
+struct scull_file {
+	struct scull_dev *dev;
+	unsigned int prio;		/* lane written to, 0 is the lowest */
+	unsigned int group;		/* consumer group read for */
+	bool stream;			/* reads ignore message boundaries */
+	size_t zcopy_min;		/* writes this big go zero-copy, 0 = never */
+	u64 ttl_ns;			/* messages written expire after this, 0 = never */
+	bool peek;			/* reads wait for TCOMMIT */
+	struct scull_peek *peek_win;	/* set on the first TPEEK, window under the group's readq.lock */
+	struct scull_producer *prod;	/* fair share accounting of our writes */
+	struct eventfd_ctx *water_ev;	/* TWATERFD, under dev->waterq.lock */
+	struct list_head water_node;	/* on dev->water_fds while water_ev is set */
+	struct scull_spin rspin;	/* our reads' spin budget */
+	struct scull_spin wspin;	/* our writes' */
+	bool priv;			/* reads and writes use priv_q, not the FIFO */
+	struct scull_privq *priv_q;	/* set by the first write in private mode */
+	wait_queue_head_t priv_wq;	/* readers and writers of priv_q */
+};
+
+/*
+ * Queueing delay histogram. Bucket i counts messages that waited
+ * [2^(i-1), 2^i) ns in the queue, the last bucket takes everything
+ * above. One copy per cpu so readers never share a cache line.
+ */
+struct scull_lat_hist {
+	u64 bucket[SCULL_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct scull_lat_hist, scull_lat);
+static struct dentry *scull_debugfs; //debugfs directory
+
+static void scull_lat_record(u64 delta)
+{
+	int i = min_t(int, fls64(delta), SCULL_LAT_BUCKETS - 1);
+
+	this_cpu_inc(scull_lat.bucket[i]);
+}
+
+static void scull_lat_sum(struct scull_lat_hist *sum)
+{
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct scull_lat_hist *h = per_cpu_ptr(&scull_lat, cpu);
+
+		for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+			sum->bucket[i] += READ_ONCE(h->bucket[i]);
+	}
+}
+
+/* upper bound in ns of the bucket holding the p-th permille */
+static u64 scull_lat_pct(struct scull_lat_hist *sum, u64 total, int permille)
+{
+	u64 want = div_u64(total * permille + 999, 1000);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < SCULL_LAT_BUCKETS - 1; i++) {
+		seen += sum->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	return 1ULL << i;
+}
+
+static int scull_lat_show(struct seq_file *m, void *v)
+{
+	struct scull_lat_hist sum;
+	u64 total = 0;
+	int i;
+
+	scull_lat_sum(&sum);
+	for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+		total += sum.bucket[i];
+
+	seq_printf(m, "recording: %s\n", scull_fifo_latency ? "on" : "off");
+	seq_printf(m, "count: %llu\n", total);
+	if (total == 0)
+		return 0;
+	seq_printf(m, "p50: <%llu ns\n", scull_lat_pct(&sum, total, 500));
+	seq_printf(m, "p90: <%llu ns\n", scull_lat_pct(&sum, total, 900));
+	seq_printf(m, "p99: <%llu ns\n", scull_lat_pct(&sum, total, 990));
+	seq_printf(m, "p99.9: <%llu ns\n", scull_lat_pct(&sum, total, 999));
+
+	for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+		if (sum.bucket[i] == 0)
+			continue;
+		if (i == SCULL_LAT_BUCKETS - 1)
+			seq_printf(m, "%12llu ns and up : %llu\n",
+				   1ULL << (i - 1), sum.bucket[i]);
+		else
+			seq_printf(m, "%12llu ns - %-12llu: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, 1ULL << i, sum.bucket[i]);
+	}
+	return 0;
+}
+
+static int scull_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_lat_show, NULL);
+}
+
+/* any write resets the histogram */
+static ssize_t scull_lat_reset(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&scull_lat, cpu), 0, sizeof(struct scull_lat_hist));
+	return count;
+}
+
+static const struct file_operations scull_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= scull_lat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= scull_lat_reset,
+	.release	= single_release,
+};
+
+/* <debugfs>/scull/quota: what every open file holds of the ring */
+static int scull_quota_show(struct seq_file *m, void *v)
+{
+	struct scull_dev *dev = m->private;
+	struct scull_producer *p;
+
+	seq_printf(m, "default quota: %lu bytes\n", READ_ONCE(scull_fifo_quota));
+	seq_printf(m, "share: %u slots\n", READ_ONCE(dev->share));
+	seq_printf(m, "over quota: %ld\n", atomic_long_read(&dev->over_quota));
+	spin_lock(&dev->prod_lock);
+	list_for_each_entry(p, &dev->prods, node)
+		seq_printf(m, "tgid %d: %u slots, %ld bytes, quota %lu, over quota %ld\n",
+			   p->tgid, atomic_read(&p->held), atomic_long_read(&p->bytes),
+			   READ_ONCE(p->quota), atomic_long_read(&p->over));
+	spin_unlock(&dev->prod_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_quota);
+
+/*
+ * Watermarks. dev->used counts the slots that aren't FREE. The device
+ * goes "over" when that reaches water_high and stays over until it is
+ * back down to water_low, so a producer that throttles on it doesn't
+ * flap around one value. Every crossing wakes pollers and signals the
+ * TWATERFD eventfds. Whoever changes used calls this afterwards; the
+ * check is redone under waterq.lock, so the last caller in always sees
+ * the latest fill.
+ */
+static void scull_water(struct scull_dev *dev)
+{
+	unsigned int high = READ_ONCE(dev->water_high);
+	struct scull_file *sf;
+	unsigned int used;
+	bool over;
+
+	if (high == 0 && !READ_ONCE(dev->water_over))
+		return; //off, the usual case
+	spin_lock(&dev->waterq.lock);
+	used = atomic_read(&dev->used);
+	high = dev->water_high;
+	over = dev->water_over;
+	if (!over && high && used >= high) {
+		over = true;
+	} else if (over && (high == 0 || used <= dev->water_low)) {
+		over = false;
+	}
+	if (over != dev->water_over) {
+		dev->water_over = over;
+		wake_up_locked_poll(&dev->waterq, over ? EPOLLPRI : EPOLLWRBAND);
+		list_for_each_entry(sf, &dev->water_fds, water_node)
+			eventfd_signal(sf->water_ev);
+	}
+	spin_unlock(&dev->waterq.lock);
+}
+
+/* TWATERHI/TWATERLO: keep low < high whenever high is on */
+static long scull_set_water(struct scull_dev *dev, unsigned long arg, bool high)
+{
+	unsigned long cap = (unsigned long)scull_nr_nodes * scull_fifo_lanes * scull_fifo_size;
+	long ret = 0;
+
+	if (arg > cap)
+		return -EINVAL;
+	spin_lock(&dev->waterq.lock);
+	if (high && arg && arg <= dev->water_low) {
+		ret = -EINVAL;
+	} else if (!high && dev->water_high && arg >= dev->water_high) {
+		ret = -EINVAL;
+	} else if (high) {
+		dev->water_high = arg;
+	} else {
+		dev->water_low = arg;
+	}
+	spin_unlock(&dev->waterq.lock);
+	scull_water(dev); //we may be over, or not any more, with the new marks
+	return ret;
+}
+
+/* TWATERFD: @fd is an eventfd, or negative to stop */
+static long scull_set_waterfd(struct scull_dev *dev, struct scull_file *sf, int fd)
+{
+	struct eventfd_ctx *ev = NULL, *old;
+
+	if (fd >= 0) {
+		ev = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ev))
+			return PTR_ERR(ev);
+	}
+	spin_lock(&dev->waterq.lock);
+	old = sf->water_ev;
+	sf->water_ev = ev;
+	if (old && !ev) {
+		list_del(&sf->water_node);
+	} else if (!old && ev) {
+		list_add(&sf->water_node, &dev->water_fds);
+	}
+	spin_unlock(&dev->waterq.lock);
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static void scull_producer_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct scull_producer, ref));
+}
+
+static inline bool scull_share_room(struct scull_producer *p, unsigned int n, unsigned int share)
+{
+	unsigned int held = atomic_read(&p->held);
+
+	return share == 0 || held == 0 || held + n <= share;
+}
+
+static void scull_uncharge(struct scull_producer *p, unsigned int n)
+{
+	atomic_long_sub((long)n * SCULL_SLOTSZ, &p->bytes);
+	atomic_sub(n, &p->held);
+	wake_up(&p->waitq);
+}
+
+/*
+ * Count @n slots against @p's share and quota; *@charged says whether
+ * they were, with both off they aren't. Waits for room in the share,
+ * fails at once over the quota.
+ */
+static int scull_charge(struct scull_dev *dev, struct scull_producer *p, unsigned int n,
+			bool nowait, bool *charged)
+{
+	unsigned long quota = READ_ONCE(p->quota);
+	long bytes = (long)n * SCULL_SLOTSZ;
+	unsigned int share, was;
+
+	*charged = false;
+	for (;;) {
+		share = READ_ONCE(dev->share);
+		if (share == 0 && quota == 0) //off, or turned off while we waited
+			return 0;
+		was = atomic_fetch_add(n, &p->held);
+		if (share == 0 || was == 0 || was + n <= share)
+			break;
+		atomic_sub(n, &p->held); //over, back out and wait for our own messages to go
+		if (nowait)
+			return -EAGAIN;
+		if (wait_event_interruptible(p->waitq, scull_share_room(p, n, READ_ONCE(dev->share))))
+			return -ERESTARTSYS;
+	}
+	if (atomic_long_add_return(bytes, &p->bytes) > quota && quota) {
+		scull_uncharge(p, n);
+		atomic_long_inc(&p->over);
+		atomic_long_inc(&dev->over_quota);
+		return -EDQUOT;
+	}
+	*charged = true;
+	return 0;
+}
+
+/*
+ * Open and close
+ */
+
+static atomic64_t scull_prod_ids = ATOMIC64_INIT(0); //0 is for messages without a producer
+
+static int scull_open(struct inode *inode, struct file *filp)
+{	
+	struct scull_file *sf = kzalloc(sizeof(*sf), GFP_KERNEL_ACCOUNT);
+	struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+
+	if (sf == NULL) {
+		return -ENOMEM;
+	}
+	sf->prod = kzalloc(sizeof(*sf->prod), GFP_KERNEL_ACCOUNT);
+	if (sf->prod == NULL) {
+		kfree(sf);
+		return -ENOMEM;
+	}
+	kref_init(&sf->prod->ref);
+	init_waitqueue_head(&sf->prod->waitq);
+	sf->prod->quota = READ_ONCE(scull_fifo_quota);
+	sf->prod->tgid = current->tgid;
+	sf->prod->id = atomic64_inc_return(&scull_prod_ids);
+	spin_lock(&dev->prod_lock);
+	list_add_tail(&sf->prod->node, &dev->prods);
+	spin_unlock(&dev->prod_lock);
+	sf->dev = dev;
+	sf->rspin.spin_ns = READ_ONCE(dev->spin_max_ns); //start optimistic, adapt from there
+	sf->wspin.spin_ns = sf->rspin.spin_ns;
+	init_waitqueue_head(&sf->priv_wq);
+	filp->private_data = sf;
+	stream_open(inode, filp); //a FIFO, no offsets
+	filp->f_mode |= FMODE_NOWAIT; //we honour IOCB_NOWAIT, see scull_wait()
+	printk(KERN_INFO "scull open\n");
+	return 0;          /* success */
+}
+
+static int scull_release(struct inode *inode, struct file *filp)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_peek *pk = sf->peek_win;
+	struct scull_group *grp = &sf->dev->group[sf->group];
+
+	if (pk) { //anything not committed goes to the rest of the group
+		spin_lock(&grp->readq.lock);
+		if (pk->count) {
+			list_add_tail(&pk->node, &grp->retry);
+			pk = NULL;
+			wake_up_locked(&grp->readq);
+		}
+		spin_unlock(&grp->readq.lock);
+		kfree(pk);
+	}
+	scull_set_waterfd(sf->dev, sf, -1);
+	spin_lock(&sf->dev->prod_lock);
+	list_del(&sf->prod->node);
+	spin_unlock(&sf->dev->prod_lock);
+	kref_put(&sf->prod->ref, scull_producer_free); //queued messages may still hold it
+	if (sf->priv_q) { //whatever is still in it goes with it
+		kvfree(sf->priv_q->buf);
+		kfree(sf->priv_q);
+	}
+	kfree(sf);
+	printk(KERN_INFO "scull close\n");
+	return 0;
+}
+
+/*
+ * Blocking. The queue has no lock of its own: the readers of consumer
+ * group g are serialized by dev->group[g].readq.lock, which protects
+ * the group's cursor in every lane, and the writers of a lane by
+ * lane->writeq.lock, which protects its in cursor. A slot goes FREE ->
+ * WRITING -> READY -> FREE. Each side only claims a slot under its own
+ * lock, copies the data with no lock held, and then hands the slot to
+ * the other side with a release store of its state.
+ *
+ * Every group sees every message, from the one copy in the ring: a
+ * reader claims the message for its group by clearing the group's bit
+ * in hdr->unread, and the slot goes back to the writers when the last
+ * group clears its bit in hdr->refs after copying. A group that falls
+ * behind holds up the writers, unless it was set to drop (TLAG), in
+ * which case a writer that needs the slot skips the group past it.
+ *
+ * All waits are exclusive, so publishing one slot wakes at most one
+ * task per group, and that task comes back from the wait already
+ * holding the lock of its side with its slot ready to claim. If there
+ * is another slot ready after the one it claimed, it passes the wakeup
+ * on.
+ */
+
+static inline struct scull_hdr *scull_slot(struct scull_lane *lane, unsigned int i)
+{
+	return (struct scull_hdr *)(lane->start + i * SCULL_SLOTSZ);
+}
+
+static inline unsigned int scull_next(unsigned int i)
+{
+#ifdef SCULL_FIFO_SIZE_FIXED
+	return (i + 1) & (SCULL_FIFO_SIZE_FIXED - 1);
+#else
+	if (static_branch_likely(&scull_fifo_pow2))
+		return (i + 1) & (scull_fifo_size - 1);
+	return (i + 1 == scull_fifo_size) ? 0 : i + 1;
+#endif
+}
+
+static inline unsigned int scull_advance(unsigned int i, unsigned int n)
+{
+#ifdef SCULL_FIFO_SIZE_FIXED
+	return (i + n) & (SCULL_FIFO_SIZE_FIXED - 1);
+#else
+	if (static_branch_likely(&scull_fifo_pow2))
+		return (i + n) & (scull_fifo_size - 1);
+	return (i + n) % scull_fifo_size; //a divide, only for odd sizes
+#endif
+}
+
+static inline unsigned int scull_nslots(size_t len)
+{
+	return len ? DIV_ROUND_UP(len, SCULL_ELEMSZ) : 1;
+}
+
+static inline bool scull_slot_is(struct scull_lane *lane, unsigned int i, int state)
+{
+	return smp_load_acquire(&scull_slot(lane, i)->state) == state;
+}
+
+static inline struct scull_lane *scull_lane(struct scull_dev *dev, int l)
+{
+	return &dev->node[l / scull_fifo_lanes][l % scull_fifo_lanes];
+}
+
+/* the set of lanes local to the caller */
+static inline int scull_home(void)
+{
+	return scull_nr_nodes > 1 ? numa_node_id() : 0;
+}
+
+/* the lane a writer at @prio queues to */
+static inline struct scull_lane *scull_wlane(struct scull_dev *dev, unsigned int prio)
+{
+	return &dev->node[scull_home()][prio];
+}
+
+/* group @g has the message at its cursor in @lane to claim */
+static inline bool scull_cur_ready(struct scull_lane *lane, unsigned int g)
+{
+	struct scull_cursor *cur = &lane->cur[g];
+	unsigned int slot = READ_ONCE(cur->out);
+
+	return !READ_ONCE(cur->busy) && scull_slot_is(lane, slot, SCULL_SLOT_READY) &&
+	       test_bit(g, &scull_slot(lane, slot)->unread);
+}
+
+/*
+ * Under the group's readq.lock, the message at its cursor just read:
+ * move the cursor past it and past the ones after it the group already
+ * took out of order (scull_rr_pick()), to the first one it still has
+ * to read, or lane->in. Nothing from the cursor to lane->in can be
+ * reused meanwhile, since the message at the cursor isn't released yet
+ * and writers only claim slots at lane->in; a FREE slot there is a
+ * message every group is done with, and still knows its size.
+ */
+static void scull_cur_advance(struct scull_lane *lane, unsigned int g)
+{
+	struct scull_cursor *cur = &lane->cur[g];
+	unsigned int in = smp_load_acquire(&lane->in);
+	unsigned int i = scull_advance(cur->out, scull_slot(lane, cur->out)->nslots);
+	struct scull_hdr *hdr;
+
+	while (i != in) {
+		hdr = scull_slot(lane, i);
+		if (smp_load_acquire(&hdr->state) == SCULL_SLOT_WRITING || test_bit(g, &hdr->unread))
+			break;
+		i = scull_advance(i, hdr->nslots);
+	}
+	cur->out = i;
+	cur->off = 0;
+}
+
+/*
+ * Fair share round-robin. With TSHARE on, group @g's next message in
+ * @lane isn't simply the one at its cursor: of the next SCULL_RR_WINDOW
+ * messages the group hasn't read, it's the oldest one of the producer
+ * that comes after the one read last, in the order the producers opened
+ * the device, wrapping around to the first. So every producer with
+ * something queued gets a message read per turn, however many the
+ * others have queued in front of it. Only the lane's order within a
+ * producer is kept. Stream reads stay in ring order. Under the group's
+ * readq.lock; the message at the returned slot is ready to claim.
+ */
+static unsigned int scull_rr_pick(struct scull_dev *dev, struct scull_lane *lane, unsigned int g)
+{
+	struct scull_cursor *cur = &lane->cur[g];
+	unsigned int in = smp_load_acquire(&lane->in), i = cur->out, k, next = cur->out, lowest = cur->out;
+	u64 last = dev->group[g].rr_last, next_id = U64_MAX, lowest_id = U64_MAX, id;
+	struct scull_hdr *hdr;
+	int state;
+
+	if (!READ_ONCE(dev->share))
+		return cur->out;
+	for (k = 0; k < SCULL_RR_WINDOW && i != in; k++) {
+		hdr = scull_slot(lane, i);
+		state = smp_load_acquire(&hdr->state);
+		if (state == SCULL_SLOT_WRITING)
+			break; //its size isn't known yet
+		if (state == SCULL_SLOT_READY && test_bit(g, &hdr->unread) &&
+		    !(i == cur->out && cur->busy)) {
+			id = hdr->prod ? hdr->prod->id : 0; //the slot's reference keeps prod around
+			if (id > last && id < next_id) {
+				next_id = id;
+				next = i;
+			}
+			if (id < lowest_id) {
+				lowest_id = id;
+				lowest = i;
+			}
+		}
+		i = scull_advance(i, hdr->nslots);
+	}
+	return next_id != U64_MAX ? next : lowest;
+}
+
+/*
+ * Pick the lane the next read of group @g comes from: the highest one with a
+ * message ready, on our own node before the others. With fair_limit
+ * set, a lane that had a message ready but was passed over fair_limit
+ * times gets served next, so the higher lanes get at most fair_limit
+ * reads for every one of it. That also bounds how long another node's
+ * lane can wait while our own keeps us busy; with strict priority it
+ * waits for readers on its own node.
+ * Only a reader about to claim (@claim) updates the counts. Returns -1
+ * if all lanes are empty.
+ */
+static int scull_pick_lane(struct scull_dev *dev, unsigned int g, bool claim)
+{
+	unsigned int limit = READ_ONCE(dev->fair_limit);
+	int home = scull_home();
+	struct scull_lane *lane;
+	int i, k, l, pick = -1;
+
+	for (i = scull_fifo_lanes - 1; i >= 0; i--) {
+		for (k = 0; k < scull_nr_nodes; k++) {
+			l = (home + k) % scull_nr_nodes * scull_fifo_lanes + i;
+			lane = scull_lane(dev, l);
+			if (!scull_cur_ready(lane, g))
+				continue;
+			if (pick < 0) {
+				pick = l;
+				if (!claim || limit == 0)
+					goto out;
+			} else if (++lane->cur[g].skipped >= limit) {
+				pick = l; //starved long enough, its turn
+				goto out;
+			}
+		}
+	}
+out:
+	if (claim && pick >= 0)
+		scull_lane(dev, pick)->cur[g].skipped = 0;
+	return pick;
+}
+
+/*
+ * Under the group's readq.lock: the oldest message on its retry list,
+ * or NULL, also while a stream reader holds it (like cur->busy)
+ */
+static struct scull_msgref *scull_retry_head(struct scull_dev *dev, unsigned int g)
+{
+	struct scull_peek *pk;
+
+	pk = list_first_entry_or_null(&dev->group[g].retry, struct scull_peek, node);
+	return pk && !pk->msg[pk->head].busy ? &pk->msg[pk->head] : NULL;
+}
+
+/* group @g has a message, in any lane or given back by a closed peek reader */
+static bool scull_readable(struct scull_dev *dev, struct scull_lane *lane, unsigned int g)
+{
+	return scull_retry_head(dev, g) != NULL || scull_pick_lane(dev, g, false) >= 0;
+}
+
+/* ... and take it off */
+static bool scull_take_retry(struct scull_dev *dev, unsigned int g, struct scull_msgref *m)
+{
+	struct list_head *retry = &dev->group[g].retry;
+	struct scull_peek *pk;
+
+	if (list_empty(retry))
+		return false;
+	pk = list_first_entry(retry, struct scull_peek, node);
+	*m = pk->msg[pk->head];
+	pk->head = (pk->head + 1) % SCULL_PEEK_MAX;
+	if (--pk->count == 0) {
+		list_del(&pk->node);
+		kfree(pk);
+	}
+	return true;
+}
+
+/* the message's deadline has passed, nobody should start on it any more */
+static inline bool scull_expired(struct scull_hdr *hdr)
+{
+	u64 deadline = READ_ONCE(hdr->deadline);
+
+	return deadline && ktime_get_ns() >= deadline;
+}
+
+/*
+ * The message in @slot is only held up by groups that haven't started
+ * on it and either drop (TLAG) or are too late for it anyway, because
+ * it expired: a writer may take it from them.
+ */
+static bool scull_droppable(struct scull_dev *dev, struct scull_lane *lane, unsigned int slot)
+{
+	unsigned long mask = READ_ONCE(dev->drop_mask);
+	struct scull_hdr *hdr = scull_slot(lane, slot);
+	unsigned long held;
+	bool expired;
+	int g;
+
+	if (!scull_slot_is(lane, slot, SCULL_SLOT_READY))
+		return false;
+	expired = scull_expired(hdr);
+	if (!mask && !expired)
+		return false;
+	held = atomic_read(&hdr->refs);
+	if (held == 0 || (!expired && (held & ~mask))) //on its way out, or a blocking group wants it
+		return false;
+	for_each_set_bit(g, &held, scull_fifo_groups) {
+		if (!test_bit(g, &hdr->unread) || READ_ONCE(lane->cur[g].busy))
+			return false; //being read right now, it'll be free soon
+	}
+	return true;
+}
+
+/* the n slots from lane->in on are free, or will be once we drop laggards */
+static bool scull_writable(struct scull_dev *dev, struct scull_lane *lane, unsigned int n)
+{
+	unsigned int i = READ_ONCE(lane->in), k;
+
+	while (n) {
+		if (scull_slot_is(lane, i, SCULL_SLOT_FREE)) {
+			n--;
+			i = scull_next(i);
+		} else if (scull_droppable(dev, lane, i)) {
+			k = min(n, READ_ONCE(scull_slot(lane, i)->nslots));
+			n -= k;
+			i = scull_advance(i, k);
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Spin-then-sleep. Before going to sleep a task polls the slot it is
+ * waiting for for up to spin_ns, so a partner that shows up a few
+ * microseconds later doesn't cost a wakeup and a context switch.
+ *
+ * spin_ns adapts like haltpoll: if we slept but were woken within
+ * spin_max_ns, spinning a little longer would have paid off, so the
+ * budget grows; if the sleep was longer than that, spinning was wasted
+ * and the budget shrinks. A spin that succeeds leaves it alone.
+ */
+static void scull_spin_adapt(struct scull_dev *dev, struct scull_spin *sp, u64 slept)
+{
+	unsigned int max = READ_ONCE(dev->spin_max_ns);
+	unsigned int ns = READ_ONCE(sp->spin_ns);
+
+	if (slept <= max) {
+		ns = ns ? min(ns * 2, max) : max / 8; //grow
+	} else {
+		ns /= 2; //shrink
+	}
+	WRITE_ONCE(sp->spin_ns, ns);
+}
+
+/*
+ * Wait until @cond is true. Called and returns with wq->lock held, the
+ * lock is only dropped to spin or sleep. With @nowait (O_NONBLOCK or
+ * IOCB_NOWAIT, e.g. io_uring's first attempt) it fails with EAGAIN
+ * instead; io_uring then waits for scull_poll() to report the file
+ * ready and retries, so nobody has to park a thread in here.
+ *
+ * A writer that needs more than one slot waits non-exclusively: a
+ * single freed slot may not be enough for it, and if it took the one
+ * exclusive wakeup and went back to sleep, a writer behind it that
+ * needed just that slot would never hear about it.
+ */
+static int scull_wait(struct scull_dev *dev, wait_queue_head_t *wq,
+		      bool (*cond)(struct scull_dev *, struct scull_lane *, unsigned int),
+		      struct scull_lane *lane, unsigned int n, struct scull_spin *sp,
+		      bool write, bool nowait)
+{
+	unsigned int ns;
+	u64 t;
+	int ret;
+
+	if (cond(dev, lane, n)) //fast path, no waiting
+		return 0;
+	if (nowait)
+		return -EAGAIN;
+
+	ns = min(READ_ONCE(sp->spin_ns), READ_ONCE(dev->spin_max_ns));
+	if (ns) {
+		spin_unlock(&wq->lock);
+		t = ktime_get_ns() + ns;
+		while (!cond(dev, lane, n) && !need_resched() && ktime_get_ns() < t)
+			cpu_relax();
+		spin_lock(&wq->lock);
+		if (cond(dev, lane, n))
+			return 0;
+	}
+
+	trace_scull_block(write);
+	t = ktime_get_ns();
+	if (n > 1)
+		ret = wait_event_interruptible_locked(*wq, cond(dev, lane, n));
+	else
+		ret = wait_event_interruptible_exclusive_locked(*wq, cond(dev, lane, n));
+	if (ret != 0) {
+		return ret;
+	}
+	if (READ_ONCE(dev->spin_max_ns))
+		scull_spin_adapt(dev, sp, ktime_get_ns() - t);
+	trace_scull_wake(write);
+	return 0;
+}
+
+/*
+ * Zero-copy messages. A large enough write on an fd that asked for it
+ * (SCULL_IOCTZCOPY) doesn't copy its data into the queue: it pins the
+ * writer's pages and queues a single slot pointing at them, and the
+ * reader copies straight from those pages into its own buffer. The
+ * data has to stay put until then, so the writer sleeps until the
+ * reader is done with it.
+ */
+struct scull_zc {
+	struct kref ref;		/* the writer's and the slot's */
+	struct completion done;		/* the reader is done with the pages */
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int offset;		/* of the data in pages[0] */
+	struct llist_node dead;		/* on scull_zc_dead, see scull_zc_free_later() */
+};
+
+static inline struct scull_zc **scull_zc_of(struct scull_hdr *hdr)
+{
+	return (struct scull_zc **)(hdr + 1);
+}
+
+static void scull_zc_free(struct kref *ref)
+{
+	struct scull_zc *zc = container_of(ref, struct scull_zc, ref);
+
+	unpin_user_pages(zc->pages, zc->nr_pages);
+	kvfree(zc->pages);
+	kfree(zc);
+}
+
+/*
+ * The slot's reference is normally not the last, the writer waits for
+ * it. If the writer was killed it is, and it may be put from under a
+ * lane's writeq.lock (drops, expiry) where kvfree() can't be called,
+ * so that put frees through a work item.
+ */
+static LLIST_HEAD(scull_zc_dead);
+
+static void scull_zc_reap(struct work_struct *work)
+{
+	struct llist_node *dead = llist_del_all(&scull_zc_dead);
+	struct scull_zc *zc, *tmp;
+
+	llist_for_each_entry_safe(zc, tmp, dead, dead)
+		scull_zc_free(&zc->ref);
+}
+
+static DECLARE_WORK(scull_zc_work, scull_zc_reap);
+
+static void scull_zc_free_later(struct kref *ref)
+{
+	struct scull_zc *zc = container_of(ref, struct scull_zc, ref);
+
+	if (llist_add(&zc->dead, &scull_zc_dead))
+		schedule_work(&scull_zc_work);
+}
+
+static struct scull_zc *scull_zc_pin(const char __user *buf, size_t count)
+{
+	unsigned long addr = (unsigned long)buf;
+	struct scull_zc *zc;
+	int pinned;
+
+	zc = kmalloc(sizeof(*zc), GFP_KERNEL_ACCOUNT);
+	if (zc == NULL)
+		return ERR_PTR(-ENOMEM);
+	zc->offset = offset_in_page(addr);
+	zc->nr_pages = DIV_ROUND_UP(zc->offset + count, PAGE_SIZE);
+	zc->pages = kvmalloc_array(zc->nr_pages, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+	if (zc->pages == NULL) {
+		kfree(zc);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	//we only ever read the pages, so no FOLL_WRITE; nobody may ever read the message, so long term
+	pinned = pin_user_pages_fast(addr & PAGE_MASK, zc->nr_pages, FOLL_LONGTERM, zc->pages);
+	if (pinned != zc->nr_pages) {
+		if (pinned > 0)
+			unpin_user_pages(zc->pages, pinned);
+		kvfree(zc->pages);
+		kfree(zc);
+		return ERR_PTR(pinned < 0 ? pinned : -EFAULT);
+	}
+	kref_init(&zc->ref);
+	init_completion(&zc->done);
+	return zc;
+}
+
+static int scull_zc_copy_out(struct scull_zc *zc, size_t off, struct iov_iter *to, size_t n)
+{
+	unsigned int pgoff;
+	size_t chunk;
+
+	off += zc->offset;
+	while (n) {
+		pgoff = offset_in_page(off);
+		chunk = min_t(size_t, n, PAGE_SIZE - pgoff);
+		if (copy_page_to_iter(zc->pages[off >> PAGE_SHIFT], pgoff, chunk, to) != chunk)
+			return -EFAULT;
+		n -= chunk;
+		off += chunk;
+	}
+	return 0;
+}
+
+/* every group is done with the message in @slot, mark its slots FREE */
+static void scull_free_slot(struct scull_dev *dev, struct scull_lane *lane, unsigned int slot)
+{
+	struct scull_hdr *hdr = scull_slot(lane, slot);
+	unsigned int i, n = hdr->nslots;
+	struct scull_producer *prod = hdr->prod;
+	struct scull_zc *zc = NULL;
+
+	if (hdr->flags & SCULL_HDR_ZCOPY)
+		zc = *scull_zc_of(hdr);
+
+	for (i = 1; i < n; i++)
+		smp_store_release(&scull_slot(lane, scull_advance(slot, i))->state, SCULL_SLOT_FREE);
+	smp_store_release(&hdr->state, SCULL_SLOT_FREE);
+	atomic_sub(n, &dev->used);
+	scull_water(dev);
+	if (prod) { //out of its producer's share and quota
+		scull_uncharge(prod, n);
+		kref_put(&prod->ref, scull_producer_free);
+	}
+
+	if (zc) { //let the writer go
+		complete(&zc->done);
+		kref_put(&zc->ref, scull_zc_free_later);
+	}
+}
+
+/* ... and give them back to the writers */
+static void scull_put_slot(struct scull_dev *dev, struct scull_lane *lane, unsigned int slot)
+{
+	scull_free_slot(dev, lane, slot);
+	wake_up(&lane->writeq);
+	if (READ_ONCE(lane->spilling)) { //room to replay some of the spill
+		queue_work(system_unbound_wq, &lane->spill_work);
+	}
+}
+
+/* group @g has read the message in @slot, the last group frees it */
+static void scull_release_slot(struct scull_dev *dev, struct scull_lane *lane,
+			       unsigned int slot, unsigned int g)
+{
+	struct scull_hdr *hdr = scull_slot(lane, slot);
+
+	if (atomic_fetch_andnot(BIT(g), &hdr->refs) == BIT(g)) {
+		scull_put_slot(dev, lane, slot);
+	} else if (READ_ONCE(dev->drop_mask) || READ_ONCE(hdr->deadline)) {
+		wake_up(&lane->writeq); //only laggards left on it, maybe
+	}
+}
+
+/*
+ * Under lane->writeq.lock: skip the groups holding up the message in
+ * @slot past it, the drop-policy ones or all of them if it expired.
+ * True if that freed it.
+ */
+static bool scull_drop(struct scull_dev *dev, struct scull_lane *lane, unsigned int slot)
+{
+	struct scull_hdr *hdr = scull_slot(lane, slot);
+	unsigned long held = atomic_read(&hdr->refs);
+	bool expired = scull_expired(hdr);
+	struct scull_cursor *cur;
+	bool last = false;
+	int g;
+
+	if (!expired && (held & ~READ_ONCE(dev->drop_mask)))
+		return false;
+	for_each_set_bit(g, &held, scull_fifo_groups) {
+		cur = &lane->cur[g];
+		spin_lock(&dev->group[g].readq.lock);
+		if (!test_bit(g, &hdr->unread) || cur->busy) { //a reader got to it after all
+			spin_unlock(&dev->group[g].readq.lock);
+			return false;
+		}
+		clear_bit(g, &hdr->unread);
+		scull_cur_advance(lane, g); //the oldest message in the lane, so it's at the cursor
+		spin_unlock(&dev->group[g].readq.lock);
+		atomic64_inc(expired ? &dev->group[g].expired : &dev->group[g].dropped);
+		last = atomic_fetch_andnot(BIT(g), &hdr->refs) == BIT(g);
+	}
+	if (last)
+		scull_free_slot(dev, lane, slot); //we hold writeq.lock, the caller takes them
+	return last;
+}
+
+/*
+ * Under lane->writeq.lock: make the n slots from lane->in FREE,
+ * dropping messages only lagging drop-policy groups still hold.
+ */
+static bool scull_make_room(struct scull_dev *dev, struct scull_lane *lane, unsigned int n)
+{
+	unsigned int i = lane->in;
+
+	while (n) {
+		if (scull_slot_is(lane, i, SCULL_SLOT_FREE)) {
+			n--;
+			i = scull_next(i);
+		} else if (!scull_droppable(dev, lane, i) || !scull_drop(dev, lane, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Expired messages are skipped by readers when they get to them, and a
+ * writer that finds the ring full takes back the ones at lane->in. But
+ * a writer asleep on a full ring isn't woken when the message in its
+ * way expires, so before it sleeps (or a poller waits) it arms this
+ * for that message's deadline: the sweep frees whatever has expired
+ * from lane->in on and wakes the writers, then re-arms for the next
+ * deadline in the way if there is one. A message that expired while
+ * a reader held it is taken care of by scull_release_slot().
+ */
+static void scull_expire_arm(struct scull_lane *lane)
+{
+	struct scull_hdr *hdr;
+	u64 deadline, now;
+
+	if (!scull_slot_is(lane, READ_ONCE(lane->in), SCULL_SLOT_READY))
+		return;
+	hdr = scull_slot(lane, READ_ONCE(lane->in));
+	deadline = READ_ONCE(hdr->deadline);
+	now = ktime_get_ns();
+	if (deadline <= now) //never, or already: whoever lets go of it wakes the writers
+		return;
+	if (delayed_work_pending(&lane->expire_work) && READ_ONCE(lane->expire_at) <= deadline)
+		return; //armed for this one or an earlier one already
+	WRITE_ONCE(lane->expire_at, deadline); //racing armers at worst sweep once too often
+	mod_delayed_work(system_wq, &lane->expire_work, nsecs_to_jiffies(deadline - now) + 1);
+}
+
+static void scull_expire_sweep(struct work_struct *work)
+{
+	struct scull_lane *lane = container_of(to_delayed_work(work), struct scull_lane, expire_work);
+	struct scull_dev *dev = &scull_dev;
+	unsigned int i, n;
+	bool freed = false;
+
+	WRITE_ONCE(lane->expire_at, 0);
+	spin_lock(&lane->writeq.lock);
+	i = lane->in;
+	while (scull_slot_is(lane, i, SCULL_SLOT_READY) && scull_expired(scull_slot(lane, i))) {
+		n = scull_slot(lane, i)->nslots;
+		if (!scull_droppable(dev, lane, i) || !scull_drop(dev, lane, i))
+			break; //a reader has it, it'll be back soon
+		freed = true;
+		i = scull_advance(i, n);
+	}
+	if (freed) {
+		wake_up_locked(&lane->writeq); //pollers, and one writer that passes it on
+	}
+	spin_unlock(&lane->writeq.lock);
+	scull_expire_arm(lane);
+}
+
+/* hand a filled in message to every consumer group */
+static void scull_publish(struct scull_dev *dev, struct scull_hdr *hdr)
+{
+	unsigned long groups = GENMASK(scull_fifo_groups - 1, 0);
+	int g;
+
+	hdr->unread = groups;
+	atomic_set(&hdr->refs, groups);
+	smp_store_release(&hdr->state, SCULL_SLOT_READY); //publish the message, all slots at once
+	for (g = 0; g < scull_fifo_groups; g++)
+		wake_up(&dev->group[g].readq);
+}
+
+/*
+ * Copy @n bytes starting at byte @off of the message in @slot to the
+ * reader, following it into the slots after @slot as needed.
+ */
+static int scull_copy_out(struct scull_lane *lane, unsigned int slot, size_t off,
+			  struct iov_iter *to, size_t n)
+{
+	struct scull_hdr *hdr = scull_slot(lane, slot);
+	size_t chunk;
+
+	if (hdr->flags & SCULL_HDR_ZCOPY)
+		return scull_zc_copy_out(*scull_zc_of(hdr), off, to, n);
+
+	slot = scull_advance(slot, off / SCULL_ELEMSZ);
+	off %= SCULL_ELEMSZ;
+	while (n) {
+		chunk = min_t(size_t, n, SCULL_ELEMSZ - off);
+		if (copy_to_iter((char *)(scull_slot(lane, slot) + 1) + off, chunk, to) != chunk)
+			return -EFAULT;
+		n -= chunk;
+		off = 0;
+		slot = scull_next(slot);
+	}
+	return 0;
+}
+
+/* and the other way, a whole message of @n bytes into @slot on */
+static int scull_copy_in(struct scull_lane *lane, unsigned int slot,
+			 struct iov_iter *from, size_t n)
+{
+	size_t chunk;
+
+	while (n) {
+		chunk = min_t(size_t, n, SCULL_ELEMSZ);
+		if (copy_from_iter(scull_slot(lane, slot) + 1, chunk, from) != chunk)
+			return -EFAULT;
+		n -= chunk;
+		slot = scull_next(slot);
+	}
+	return 0;
+}
+
+/*
+ * Overflow. With scull_spill_dir set, every lane gets an unlinked
+ * (O_TMPFILE) file in that directory, and a writer that finds the ring
+ * full appends its message there instead of waiting. From then on the
+ * lane is "spilling": all writes go to the end of the file, so nothing
+ * overtakes what's in it, and scull_spill_replay() moves the records
+ * back into the ring in order as readers free slots. Once the file is
+ * empty the lane goes back to normal.
+ *
+ * The file is used as a ring of scull_spill_max bytes; a writer that
+ * finds it full blocks (or gets EAGAIN) as it would have on the FIFO.
+ */
+struct scull_spill_rec {
+	u64 len;	/* bytes of message following */
+	u64 stamp;	/* enqueue time, carried over into the slot */
+	u64 deadline;	/* ditto */
+	pid_t tgid;	/* writer, ditto; the sequence number is given on replay */
+};
+
+static inline u64 scull_spill_used(struct scull_lane *lane)
+{
+	return READ_ONCE(lane->spill_wpos) - READ_ONCE(lane->spill_rpos);
+}
+
+static inline bool scull_spill_room(struct scull_lane *lane, size_t len)
+{
+	return scull_spill_used(lane) + sizeof(struct scull_spill_rec) + len <= scull_spill_max;
+}
+
+/* all of @it to or from the spill file at @pos, wrapping at the end */
+static int scull_spill_io(struct file *f, struct iov_iter *it, u64 pos, bool write)
+{
+	size_t len = iov_iter_count(it), chunk;
+	loff_t fpos;
+	ssize_t n;
+	u64 off;
+
+	while (len) {
+		div64_u64_rem(pos, scull_spill_max, &off);
+		chunk = min_t(u64, len, scull_spill_max - off);
+		iov_iter_truncate(it, chunk);
+		fpos = off;
+		n = write ? vfs_iter_write(f, it, &fpos, 0) : vfs_iter_read(f, it, &fpos, 0);
+		if (n != chunk)
+			return n < 0 ? n : -EIO;
+		len -= chunk;
+		iov_iter_reexpand(it, len);
+		pos += chunk;
+	}
+	return 0;
+}
+
+static ssize_t scull_spill_write(struct scull_lane *lane, struct iov_iter *from, u64 ttl_ns,
+				 bool nowait)
+{
+	struct scull_spill_rec rec = {
+		.len = iov_iter_count(from),
+		.stamp = ktime_get_ns(),
+		.tgid = task_tgid_nr(current),
+	};
+	struct kvec kv = { .iov_base = &rec, .iov_len = sizeof(rec) };
+	struct iov_iter it;
+	int ret;
+
+	rec.deadline = ttl_ns ? rec.stamp + ttl_ns : 0;
+	for (;;) {
+		if (mutex_lock_interruptible(&lane->spill_lock))
+			return -ERESTARTSYS;
+		if (scull_spill_room(lane, rec.len))
+			break;
+		mutex_unlock(&lane->spill_lock);
+		if (nowait)
+			return -EAGAIN;
+		if (wait_event_interruptible(lane->spillq, scull_spill_room(lane, rec.len)))
+			return -ERESTARTSYS;
+	}
+
+	iov_iter_kvec(&it, ITER_SOURCE, &kv, 1, sizeof(rec));
+	ret = scull_spill_io(lane->spill, &it, lane->spill_wpos, true);
+	if (ret == 0)
+		ret = scull_spill_io(lane->spill, from, lane->spill_wpos + sizeof(rec), true);
+	if (ret == 0) //only now is it in there
+		WRITE_ONCE(lane->spill_wpos, lane->spill_wpos + sizeof(rec) + rec.len);
+	mutex_unlock(&lane->spill_lock);
+	if (ret != 0)
+		return ret;
+
+	spin_lock(&lane->writeq.lock);
+	lane->spilling = true; //the replay may have caught up while we waited for spill_lock
+	spin_unlock(&lane->writeq.lock);
+	queue_work(system_unbound_wq, &lane->spill_work);
+	return rec.len;
+}
+
+/* move spilled messages back into the ring while it has room */
+static void scull_spill_replay(struct work_struct *work)
+{
+	struct scull_lane *lane = container_of(work, struct scull_lane, spill_work);
+	struct scull_dev *dev = &scull_dev;
+	struct scull_spill_rec rec;
+	struct kvec kv;
+	struct iov_iter it;
+	struct scull_hdr *hdr;
+	unsigned int slot, n, i;
+	size_t done, chunk;
+	int ret;
+
+	mutex_lock(&lane->spill_lock);
+	for (;;) {
+		if (lane->spill_rpos == lane->spill_wpos) {
+			spin_lock(&lane->writeq.lock);
+			lane->spilling = false; //caught up, writers may use the ring again
+			spin_unlock(&lane->writeq.lock);
+			wake_up(&lane->spillq); //zero-copy writers wait for this
+			break;
+		}
+
+		kv.iov_base = &rec;
+		kv.iov_len = sizeof(rec);
+		iov_iter_kvec(&it, ITER_DEST, &kv, 1, sizeof(rec));
+		ret = scull_spill_io(lane->spill, &it, lane->spill_rpos, false);
+		if (ret != 0) { //can't get at the rest, drop it all
+			printk(KERN_WARNING "scull: spill read failed (%d), dropping %llu bytes\n",
+			       ret, lane->spill_wpos - lane->spill_rpos);
+			WRITE_ONCE(lane->spill_rpos, lane->spill_wpos);
+			wake_up(&lane->spillq);
+			continue;
+		}
+
+		n = scull_nslots(rec.len);
+		spin_lock(&lane->writeq.lock);
+		if (!scull_make_room(dev, lane, n)) { //scull_put_slot() requeues us
+			spin_unlock(&lane->writeq.lock);
+			break;
+		}
+		slot = lane->in; //claim the slots, like a writer
+		for (i = 0; i < n; i++) {
+			scull_slot(lane, scull_advance(slot, i))->state = SCULL_SLOT_WRITING;
+		}
+		smp_store_release(&lane->in, scull_advance(slot, n)); //see scull_cur_advance()
+		hdr = scull_slot(lane, slot);
+		hdr->seq = lane->seq++;
+		spin_unlock(&lane->writeq.lock);
+		atomic_add(n, &dev->used);
+		scull_water(dev);
+
+		hdr->flags = 0;
+		hdr->nslots = n;
+		hdr->len = rec.len;
+		hdr->prod = NULL; //its writer is long gone, maybe
+		for (done = 0, i = slot; done < rec.len; done += chunk, i = scull_next(i)) {
+			chunk = min_t(size_t, rec.len - done, SCULL_ELEMSZ);
+			kv.iov_base = scull_slot(lane, i) + 1;
+			kv.iov_len = chunk;
+			iov_iter_kvec(&it, ITER_DEST, &kv, 1, chunk);
+			if (scull_spill_io(lane->spill, &it,
+					   lane->spill_rpos + sizeof(rec) + done, false) != 0) {
+				hdr->flags = SCULL_HDR_DEAD;
+				break;
+			}
+		}
+		hdr->stamp = rec.stamp;
+		hdr->deadline = rec.deadline; //it may well have expired in the file, readers skip it
+		hdr->tgid = rec.tgid;
+		scull_publish(dev, hdr);
+
+		WRITE_ONCE(lane->spill_rpos, lane->spill_rpos + sizeof(rec) + rec.len);
+		wake_up(&lane->spillq);
+	}
+	mutex_unlock(&lane->spill_lock);
+}
+
+static u64 scull_delay(struct scull_hdr *hdr)
+{
+	u64 delay = ktime_get_ns() - hdr->stamp; //time spent in the queue
+
+	if (scull_fifo_latency) {
+		scull_lat_record(delay);
+	}
+	return delay;
+}
+
 /*
- * Our parameters which can be set at load time.
+ * Private queue (TPRIVATE). The waits are plain wait_event()s on the
+ * fd's priv_wq: only this fd's own threads are on it, so there is no
+ * group or lane to share a spin budget with.
  */
+static size_t scull_prec_size(size_t len)
+{
+	return ALIGN(sizeof(struct scull_prec) + len, SCULL_PREC_ALIGN);
+}
 
-static int scull_major =   SCULL_MAJOR;
-static int scull_minor =   0;
-static int scull_fifo_elemsz = SCULL_FIFO_ELEMSZ_DEFAULT; /* ELEMSZ */
-static int scull_fifo_size   = SCULL_FIFO_SIZE_DEFAULT;   /* N      */
+static bool scull_priv_readable(struct scull_file *sf)
+{
+	struct scull_privq *q = READ_ONCE(sf->priv_q);
 
-module_param(scull_major, int, S_IRUGO);
-module_param(scull_minor, int, S_IRUGO);
-module_param(scull_fifo_size, int, S_IRUGO);
-module_param(scull_fifo_elemsz, int, S_IRUGO);
+	return q && READ_ONCE(q->used) != 0;
+}
 
-MODULE_AUTHOR("jknuckle");
-MODULE_LICENSE("Dual BSD/GPL");
+static bool scull_priv_room(struct scull_file *sf, size_t len)
+{
+	struct scull_privq *q = READ_ONCE(sf->priv_q);
+
+	return q == NULL || q->size - READ_ONCE(q->used) >= scull_prec_size(len); //no queue yet is all room
+}
 
-static struct cdev scull_cdev;		/* Char device structure */
+static int scull_privq_lock(struct scull_privq *q, bool nowait)
+{
+	if (nowait) {
+		return mutex_trylock(&q->lock) ? 0 : -EAGAIN;
+	}
+	return mutex_lock_interruptible(&q->lock) ? -ERESTARTSYS : 0;
+}
 
 /*
- * Open and close
+ * The fd's private queue, allocated on first use: as many bytes as one
+ * lane of the FIFO, charged to the writer's memory cgroup.
  */
+static struct scull_privq *scull_privq_get(struct scull_file *sf)
+{
+	struct scull_privq *q = READ_ONCE(sf->priv_q);
 
-static int scull_open(struct inode *inode, struct file *filp)
-{	
-	printk(KERN_INFO "scull open\n");
-	return 0;          /* success */
+	if (q) {
+		return q;
+	}
+	q = kzalloc(sizeof(*q), GFP_KERNEL_ACCOUNT);
+	if (q == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	q->size = ALIGN_DOWN((size_t)scull_fifo_size * SCULL_SLOTSZ, SCULL_PREC_ALIGN);
+	q->buf = kvmalloc(q->size, GFP_KERNEL_ACCOUNT);
+	if (q->buf == NULL) {
+		kfree(q);
+		return ERR_PTR(-ENOMEM);
+	}
+	mutex_init(&q->lock);
+	if (cmpxchg(&sf->priv_q, NULL, q) != NULL) { //another thread beat us to it
+		kvfree(q->buf);
+		kfree(q);
+		q = READ_ONCE(sf->priv_q);
+	}
+	return q;
 }
 
-static int scull_release(struct inode *inode, struct file *filp)
+/* Copy n bytes of the ring at offset pos to or from it, wrapping at the end */
+static size_t scull_privq_copy(struct scull_privq *q, size_t pos, struct iov_iter *it,
+			       size_t n, bool out)
 {
-	printk(KERN_INFO "scull close\n");
-	return 0;
+	size_t first = min(n, q->size - pos), done;
+
+	done = out ? copy_to_iter(q->buf + pos, first, it) : copy_from_iter(q->buf + pos, first, it);
+	if (done == first && n > first) {
+		done += out ? copy_to_iter(q->buf, n - first, it) : copy_from_iter(q->buf, n - first, it);
+	}
+	return done;
+}
+
+static ssize_t scull_priv_write(struct scull_file *sf, struct iov_iter *from, bool nowait)
+{
+	size_t count = iov_iter_count(from), need = scull_prec_size(count);
+	struct scull_privq *q;
+	struct scull_prec *rec;
+	int ret;
+
+	if (count > scull_fifo_maxmsg) {
+		return -EMSGSIZE;
+	}
+	q = scull_privq_get(sf);
+	if (IS_ERR(q)) {
+		return PTR_ERR(q);
+	}
+	if (need > q->size) { //the header doesn't fit next to a lane-sized message
+		return -EMSGSIZE;
+	}
+
+	for (;;) {
+		ret = scull_privq_lock(q, nowait);
+		if (ret != 0) {
+			return ret;
+		}
+		if (q->size - q->used >= need) {
+			break;
+		}
+		mutex_unlock(&q->lock);
+		if (nowait) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(sf->priv_wq, scull_priv_room(sf, count))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (scull_privq_copy(q, (q->in + sizeof(*rec)) % q->size, from, count, false) != count) {
+		mutex_unlock(&q->lock);
+		return -EFAULT; //nothing queued, in stays where it was
+	}
+	rec = (struct scull_prec *)(q->buf + q->in);
+	rec->stamp = ktime_get_ns();
+	rec->len = count;
+	rec->tgid = task_tgid_nr(current); //as the ring path reports it
+	q->in = (q->in + need) % q->size;
+	WRITE_ONCE(q->used, q->used + need);
+	mutex_unlock(&q->lock);
+	wake_up_interruptible(&sf->priv_wq);
+	return count;
+}
+
+/*
+ * The next message of the private queue into to, cut short to what to
+ * holds, or with whole left queued (-ENOSPC) if it doesn't fit. Waits
+ * for one unless nowait. desc, if given, gets filled in as for DRAIN.
+ * Returns the bytes copied.
+ */
+static ssize_t scull_priv_take(struct scull_file *sf, struct iov_iter *to, bool nowait,
+			       bool whole, struct scull_desc *desc)
+{
+	size_t room = iov_iter_count(to), n;
+	struct scull_privq *q;
+	struct scull_prec rec;
+	ssize_t ret;
+
+	for (;;) {
+		q = READ_ONCE(sf->priv_q);
+		if (q) {
+			ret = scull_privq_lock(q, nowait);
+			if (ret != 0) {
+				return ret;
+			}
+			if (q->used) {
+				break;
+			}
+			mutex_unlock(&q->lock);
+		}
+		if (nowait) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(sf->priv_wq, scull_priv_readable(sf))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	rec = *(struct scull_prec *)(q->buf + q->out);
+	if (whole && rec.len > room) {
+		mutex_unlock(&q->lock);
+		return -ENOSPC;
+	}
+	n = min_t(size_t, rec.len, room);
+	if (n < rec.len) {
+		trace_scull_truncate(false, rec.len, n);
+	}
+	ret = n;
+	if (scull_privq_copy(q, (q->out + sizeof(rec)) % q->size, to, n, true) != n) {
+		ret = -EFAULT; //the message is gone all the same, as in the FIFO
+	}
+	if (desc) {
+		memset(desc, 0, sizeof(*desc));
+		desc->seq = q->seq;
+		desc->stamp = rec.stamp;
+		desc->tgid = rec.tgid;
+		desc->len = n;
+		if (n < rec.len) {
+			desc->flags |= SCULL_DESC_TRUNC;
+		}
+	}
+	q->seq++;
+	q->out = (q->out + scull_prec_size(rec.len)) % q->size;
+	WRITE_ONCE(q->used, q->used - scull_prec_size(rec.len));
+	mutex_unlock(&q->lock);
+	wake_up_interruptible(&sf->priv_wq);
+
+	if (scull_fifo_latency) {
+		scull_lat_record(ktime_get_ns() - rec.stamp);
+	}
+	return ret;
+}
+
+/* DRAIN for a fd in private mode, same rules as scull_drain() */
+static long scull_priv_drain(struct scull_file *sf, struct scull_drain *d,
+			     struct scull_drain __user *arg, bool nowait)
+{
+	struct scull_desc __user *udesc = u64_to_user_ptr(d->desc);
+	struct scull_desc desc;
+	struct iov_iter it;
+	size_t used = 0;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	for (i = 0; i < d->max; i++) {
+		ret = import_ubuf(ITER_DEST, u64_to_user_ptr(d->buf + used), d->buflen - used, &it);
+		if (ret == 0) {
+			ret = scull_priv_take(sf, &it, nowait || i > 0, i > 0, &desc);
+		}
+		if (ret < 0) {
+			break;
+		}
+		desc.offset = used;
+		if (copy_to_user(&udesc[i], &desc, sizeof(desc))) {
+			ret = -EFAULT;
+			break;
+		}
+		used += ret;
+	}
+
+	if (i == 0) //nothing to show for it
+		return ret;
+	if (put_user(i, &arg->count))
+		return -EFAULT;
+	return i;
+}
+
+/*
+ * Byte-stream read, like a pipe: returns whatever is queued up to
+ * count bytes, across message boundaries, and only blocks if there is
+ * nothing at all. A message that doesn't fit stays at the group's
+ * cursor with cur->off past the part already read, or on the retry
+ * list with its msgref's off moved on.
+ *
+ * The reader holds the message by marking the cursor busy without
+ * moving it, so nobody else in the group can take it, and then either
+ * consumes it or lets go of it.
+ */
+static ssize_t scull_read_stream(struct scull_dev *dev, unsigned int g, struct scull_spin *sp,
+				 struct iov_iter *to, bool nowait)
+{
+	wait_queue_head_t *rq = &dev->group[g].readq;
+	size_t count = iov_iter_count(to);
+	struct scull_msgref *m, rm;
+	struct scull_cursor *cur;
+	struct scull_lane *lane;
+	struct scull_hdr *hdr;
+	unsigned int slot;
+	size_t done = 0, n, off;
+	bool fault, consumed, expired;
+	u64 delay;
+	int ret, l;
+
+	while (done < count) {
+		spin_lock(&rq->lock);
+		if (done == 0) {
+			ret = scull_wait(dev, rq, scull_readable, NULL, g, sp, false, nowait);
+			if (ret != 0) { //interrupted or would block
+				spin_unlock(&rq->lock);
+				return ret;
+			}
+		} else if (!scull_readable(dev, NULL, g)) { //got something, don't wait for more
+			spin_unlock(&rq->lock);
+			break;
+		}
+
+		m = scull_retry_head(dev, g);
+		if (m) { //given back by a peek reader
+			hdr = scull_slot(scull_lane(dev, m->lane), m->slot);
+			expired = !(hdr->flags & SCULL_HDR_DEAD) && m->off == 0 && scull_expired(hdr);
+			if ((hdr->flags & SCULL_HDR_DEAD) || expired || hdr->len - m->off <= count) {
+				scull_take_retry(dev, g, &rm); //all of it, read like in message mode
+				m = NULL;
+			} else {
+				m->busy = true; //what fits of it, like a ring message, the rest stays on the list
+				rm = *m;
+			}
+			if (scull_readable(dev, NULL, g)) {
+				wake_up_locked(rq);
+			}
+			spin_unlock(&rq->lock);
+
+			lane = scull_lane(dev, rm.lane);
+			n = 0;
+			fault = false;
+			if (expired) {
+				atomic64_inc(&dev->group[g].expired); //too late, skip it
+			} else if (!(hdr->flags & SCULL_HDR_DEAD)) {
+				n = min(count - done, hdr->len - rm.off);
+				fault = scull_copy_out(lane, rm.slot, rm.off, to, n) != 0;
+			}
+			if (m) { //put it back with cur->off's meaning: where the next read starts
+				spin_lock(&rq->lock);
+				if (!fault)
+					m->off += n;
+				m->busy = false;
+				wake_up_locked(rq);
+				spin_unlock(&rq->lock);
+				if (fault) {
+					return done ? done : -EFAULT;
+				}
+				done += n;
+				continue;
+			}
+			delay = scull_delay(hdr); //records it in the histogram, tracing or not
+			trace_scull_dequeue(rm.lane, rm.slot, n, delay);
+			scull_release_slot(dev, lane, rm.slot, g);
+			if (fault) {
+				return done ? done : -EFAULT;
+			}
+			done += n;
+			continue;
+		}
+
+		l = scull_pick_lane(dev, g, true);
+		lane = scull_lane(dev, l);
+		cur = &lane->cur[g];
+		slot = cur->out;
+		off = cur->off;
+		hdr = scull_slot(lane, slot);
+		WRITE_ONCE(cur->busy, true); //hold it, cur->out stays put
+		spin_unlock(&rq->lock);
+
+		fault = false;
+		n = 0;
+		expired = !(hdr->flags & SCULL_HDR_DEAD) && off == 0 && scull_expired(hdr); //once started, we finish it
+		if (expired) {
+			atomic64_inc(&dev->group[g].expired);
+		} else if (!(hdr->flags & SCULL_HDR_DEAD)) {
+			n = min(count - done, hdr->len - off);
+			fault = scull_copy_out(lane, slot, off, to, n) != 0;
+			if (fault)
+				n = 0; //leave it for the next read
+		}
+		done += n;
+		consumed = off + n == hdr->len || (hdr->flags & SCULL_HDR_DEAD) || expired;
+
+		spin_lock(&rq->lock);
+		if (consumed) {
+			clear_bit(g, &hdr->unread);
+			scull_cur_advance(lane, g); //all of it read
+		} else {
+			cur->off = off + n;
+		}
+		WRITE_ONCE(cur->busy, false);
+		if (scull_readable(dev, NULL, g)) {
+			wake_up_locked(rq);
+		}
+		spin_unlock(&rq->lock);
+		if (consumed) {
+			delay = scull_delay(hdr);
+			trace_scull_dequeue(l, slot, expired ? 0 : hdr->len, delay);
+			scull_release_slot(dev, lane, slot, g);
+		} else if (READ_ONCE(dev->drop_mask) || READ_ONCE(hdr->deadline)) {
+			wake_up(&lane->writeq); //it's not busy any more, a writer may drop it
+		}
+
+		if (fault) {
+			return done ? done : -EFAULT;
+		}
+	}
+	return done;
 }
 
-//define mutex
-static DEFINE_MUTEX(mux);
-struct semaphore writee; //semaphore that blocks writing to queue
-struct semaphore reade; //semaphore thay blocks reading from queue
+/*
+ * Take the next message for group @g, in message mode: from the retry
+ * list if there's anything there, else from the best lane. The caller
+ * copies it out and releases it, unless it went into the peek window
+ * @pk. Waits for one unless @more (the rest of a batch), and leaves it
+ * alone with ENOSPC if what's left of it is more than @room.
+ */
+static int scull_take(struct scull_dev *dev, unsigned int g, struct scull_spin *sp,
+		      struct scull_peek *pk, bool nowait, bool more, size_t room, struct scull_msgref *m)
+{
+	wait_queue_head_t *rq = &dev->group[g].readq;
+	struct scull_msgref *r;
+	struct scull_cursor *cur;
+	struct scull_lane *lane;
+	struct scull_hdr *hdr;
+	bool expired;
+	u64 delay;
+	int ret;
+
+again:
+	spin_lock(&rq->lock);
+	if (pk && pk->count == SCULL_PEEK_MAX) {
+		ret = -ENOBUFS; //window full, commit some first; don't wait for (and eat) a wakeup
+	} else if (more) {
+		ret = scull_readable(dev, NULL, g) ? 0 : -EAGAIN;
+	} else {
+		ret = scull_wait(dev, rq, scull_readable, NULL, g, sp, false, nowait);
+	}
+	if (ret != 0) { //interrupted or would block
+		goto out;
+	}
+	r = scull_retry_head(dev, g);
+	if (r) {
+		hdr = scull_slot(scull_lane(dev, r->lane), r->slot);
+		expired = r->off == 0 && scull_expired(hdr);
+		if (hdr->len - r->off > room && !expired) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		scull_take_retry(dev, g, m);
+	} else {
+		m->lane = scull_pick_lane(dev, g, true); //claim the message for our group
+		lane = scull_lane(dev, m->lane);
+		cur = &lane->cur[g];
+		m->slot = scull_rr_pick(dev, lane, g);
+		m->off = m->slot == cur->out ? cur->off : 0; //a stream reader may have taken the front of it already
+		m->busy = false;
+		hdr = scull_slot(lane, m->slot);
+		expired = !(hdr->flags & SCULL_HDR_DEAD) && m->off == 0 && scull_expired(hdr);
+		if (hdr->len - m->off > room && !(hdr->flags & SCULL_HDR_DEAD) && !expired) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		clear_bit(g, &hdr->unread);
+		dev->group[g].rr_last = hdr->prod ? hdr->prod->id : 0;
+		if (m->slot == cur->out) {
+			scull_cur_advance(lane, g);
+		}
+	}
+	if (pk && !(hdr->flags & SCULL_HDR_DEAD) && !expired) {
+		pk->msg[(pk->head + pk->count++) % SCULL_PEEK_MAX] = *m; //ours until TCOMMIT
+	}
+	if (scull_readable(dev, NULL, g)) {
+		wake_up_locked(rq); //another message is there too, pass the wakeup on
+	}
+	spin_unlock(&rq->lock);
+
+	if ((hdr->flags & SCULL_HDR_DEAD) || expired) { //nothing in there for us, give it back and try again
+		if (expired) {
+			atomic64_inc(&dev->group[g].expired);
+			delay = scull_delay(hdr);
+			trace_scull_dequeue(m->lane, m->slot, 0, delay);
+		}
+		scull_release_slot(dev, scull_lane(dev, m->lane), m->slot, g);
+		goto again;
+	}
+	return 0;
+
+out:
+	spin_unlock(&rq->lock);
+	return ret;
+}
 
 /*
  * Read and Write
  */
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t scull_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	/* TODO: implement this function */
-	
-	if(down_interruptible(&reade) != 0) { //access queue only if non-empty
-		//return this if interupted
-		return -ERESTARTSYS;
+	struct file *filp = iocb->ki_filp;
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	unsigned int g = READ_ONCE(sf->group);
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (filp->f_flags & O_NONBLOCK);
+	size_t count = iov_iter_count(to);
+	struct scull_peek *pk = READ_ONCE(sf->peek) ? READ_ONCE(sf->peek_win) : NULL;
+	struct scull_msgref m;
+	struct scull_lane *lane;
+	struct scull_hdr *hdr;
+	u64 delay = 0;
+	int ret;
+
+	if (READ_ONCE(sf->priv)) {
+		return scull_priv_take(sf, to, nowait, false, NULL);
 	}
-	if (mutex_lock_interruptible(&mux)!= 0) { //only one process can change queue to avoid race condition
-		//return this if interrupted
-		return -ERESTARTSYS;
+	if (READ_ONCE(sf->stream)) {
+		return scull_read_stream(dev, g, &sf->rspin, to, nowait);
 	}
-	printk(KERN_INFO "scull read\n");
 
-	if (*((size_t*) mqueueo) < count) {
-		count = *((size_t*) mqueueo); // adjust value of count if it is larger than len of next elem
-	} 
-	mqueueo = mqueueo + sizeof(size_t); //go to start of message in queue
+	ret = scull_take(dev, g, &sf->rspin, pk, nowait, false, SIZE_MAX, &m);
+	if (ret != 0) {
+		return ret;
+	}
+	lane = scull_lane(dev, m.lane);
+	hdr = scull_slot(lane, m.slot);
 
-	if(copy_to_user(buf, mqueueo, count)) {
-		return -EFAULT; // return this if copy from queue to user space is unsuccessful.
+	if (hdr->len - m.off < count) {
+		count = hdr->len - m.off; // adjust value of count if it is larger than len of next elem
+	} else if (hdr->len - m.off > count) {
+		trace_scull_truncate(false, hdr->len - m.off, count);
 	}
 
-	if (((char*)mqueueo) > (start + ((scull_fifo_size-1) * (sizeof(size_t)+scull_fifo_elemsz)))) {
-		mqueueo = start; // go to start if at the end of the queue
+	if (scull_copy_out(lane, m.slot, m.off, to, count)) {
+		ret = -EFAULT; // return this if copy from queue to user space is unsuccessful.
 	}
-	else {
-		mqueueo = mqueueo + scull_fifo_elemsz; // go to next element in queue
+	delay = scull_delay(hdr);
+	trace_scull_dequeue(m.lane, m.slot, count, delay);
+
+	if (pk == NULL) { //in peek mode TCOMMIT does this
+		scull_release_slot(dev, lane, m.slot, g); //the last group hands the slots back to the writers
 	}
-	mutex_unlock(&mux); //unlock mutex
-	up(&writee); //signify to write that there is one less space in the buffer
-	return count; //return count on success.
+	return ret ? ret : count; //return count on success.
 }
 
+/*
+ * DRAIN: up to d.max messages in one call, their payloads packed back
+ * to back into d.buf and a struct scull_desc for each in d.desc. Waits
+ * like read() for the first one only, and stops early at the first
+ * message that doesn't fit in what's left of d.buf; only a first
+ * message bigger than all of it is cut short (SCULL_DESC_TRUNC).
+ * Returns the number of messages, also stored in d.count.
+ */
+static long scull_drain(struct file *filp, struct scull_drain __user *arg)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	unsigned int g = READ_ONCE(sf->group);
+	struct scull_peek *pk = READ_ONCE(sf->peek) ? READ_ONCE(sf->peek_win) : NULL;
+	struct scull_desc __user *udesc;
+	struct scull_desc desc;
+	struct scull_drain d;
+	struct scull_msgref m;
+	struct scull_lane *lane;
+	struct scull_hdr *hdr;
+	struct iov_iter it;
+	size_t used = 0, n;
+	unsigned int i;
+	u64 delay;
+	int ret = 0;
+
+	if (copy_from_user(&d, arg, sizeof(d)))
+		return -EFAULT;
+	if (d.max == 0)
+		return -EINVAL;
+	if (READ_ONCE(sf->priv))
+		return scull_priv_drain(sf, &d, arg, filp->f_flags & O_NONBLOCK);
+	udesc = u64_to_user_ptr(d.desc);
+
+	for (i = 0; i < d.max; i++) {
+		ret = scull_take(dev, g, &sf->rspin, pk, filp->f_flags & O_NONBLOCK, i > 0,
+				 i ? d.buflen - used : SIZE_MAX, &m);
+		if (ret != 0)
+			break;
+		lane = scull_lane(dev, m.lane);
+		hdr = scull_slot(lane, m.slot);
+
+		n = min_t(u64, hdr->len - m.off, d.buflen - used);
+		memset(&desc, 0, sizeof(desc));
+		desc.seq = hdr->seq;
+		desc.stamp = hdr->stamp;
+		desc.tgid = hdr->tgid;
+		desc.lane = m.lane;
+		desc.len = n;
+		desc.offset = used;
+		if (n < hdr->len - m.off) {
+			desc.flags |= SCULL_DESC_TRUNC;
+			trace_scull_truncate(false, hdr->len - m.off, n);
+		}
+		ret = import_ubuf(ITER_DEST, u64_to_user_ptr(d.buf + used), n, &it);
+		if (ret == 0 && scull_copy_out(lane, m.slot, m.off, &it, n))
+			ret = -EFAULT;
+		if (ret == 0 && copy_to_user(&udesc[i], &desc, sizeof(desc)))
+			ret = -EFAULT;
+		delay = scull_delay(hdr);
+		trace_scull_dequeue(m.lane, m.slot, n, delay);
+		if (pk == NULL) {
+			scull_release_slot(dev, lane, m.slot, g);
+		}
+		if (ret != 0)
+			break;
+		used += n;
+	}
+
+	if (i == 0) //nothing to show for it
+		return ret;
+	if (put_user(i, &arg->count))
+		return -EFAULT;
+	return i;
+}
 
-static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t scull_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	/* TODO: implement this function */
-	if(down_interruptible(&writee) != 0) { //access if queue isn't full
-		//return this if interupted.
-		return -ERESTARTSYS;
+	struct file *filp = iocb->ki_filp;
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (filp->f_flags & O_NONBLOCK);
+	size_t count = iov_iter_count(from);
+	unsigned int prio = READ_ONCE(sf->prio);
+	struct scull_lane *lane = scull_wlane(dev, prio);
+	size_t zcopy_min = READ_ONCE(sf->zcopy_min);
+	u64 ttl_ns = READ_ONCE(sf->ttl_ns);
+	bool zcopy = zcopy_min && count >= zcopy_min && iter_is_ubuf(from);
+	struct scull_zc *zc = NULL;
+	struct scull_hdr *hdr;
+	unsigned int slot, n, i;
+	bool charged;
+	int ret;
+
+	if (READ_ONCE(sf->priv)) {
+		return scull_priv_write(sf, from, nowait);
 	}
-	if (mutex_lock_interruptible(&mux)!= 0) { //avoids race conditions
-		//return this if interupted.
-		return -ERESTARTSYS;
+
+	/*
+	 * Zero-copy has to wait for the reader, so it's not for non-blocking
+	 * writers, and only a plain write() buffer gets pinned. Behind a
+	 * spill a message the ring can take is copied into the file like
+	 * any other; a bigger one can't go there, so it waits for the file
+	 * to drain instead of overtaking it.
+	 */
+	if (zcopy && !nowait && !(READ_ONCE(lane->spilling) && count <= scull_fifo_maxmsg)) {
+		if (count > SCULL_ZCOPY_MAXMSG) {
+			return -EMSGSIZE;
+		}
+		if (lane->spill && wait_event_interruptible(lane->spillq, !READ_ONCE(lane->spilling))) {
+			return -ERESTARTSYS;
+		}
+		zc = scull_zc_pin(from->ubuf + from->iov_offset, count); //queue the pages, not the data
+		if (IS_ERR(zc)) {
+			return PTR_ERR(zc);
+		}
+		iov_iter_advance(from, count);
+		n = 1;
+	} else {
+		if (count > scull_fifo_maxmsg) {
+			if (zcopy && count <= SCULL_ZCOPY_MAXMSG && (iocb->ki_flags & IOCB_NOWAIT) &&
+			    !(filp->f_flags & O_NONBLOCK))
+				return -EAGAIN; //only goes zero-copy, which blocks; io_uring retries from a worker
+			return -EMSGSIZE; //too big, refuse it rather than truncate it
+		}
+		n = scull_nslots(count);
 	}
-	printk(KERN_INFO "scull write\n");
 
-	if (scull_fifo_elemsz < count) {
-		count = scull_fifo_elemsz; // adjust value of count if its larger than mex len allowed for message
-	} 
-	*((size_t*)mqueuei) = count; //add length of next elem to the queue
-	mqueuei = mqueuei + sizeof(size_t); //go to start point of message
+	ret = scull_charge(dev, sf->prod, n, nowait, &charged);
+	if (ret != 0) { //we have enough in there already
+		if (zc) {
+			kref_put(&zc->ref, scull_zc_free);
+		}
+		return ret;
+	}
 
-	if (copy_from_user(mqueuei, buf, count) != 0) {
-		return -EFAULT; //return this if copy from user didn't work properly
+	spin_lock(&lane->writeq.lock);
+	if (lane->spill && !zc && (lane->spilling || !scull_make_room(dev, lane, n))) {
+		if (iocb->ki_flags & IOCB_NOWAIT) { //file I/O, io_uring has a worker retry it
+			spin_unlock(&lane->writeq.lock);
+			if (charged) {
+				scull_uncharge(sf->prod, n);
+			}
+			return -EAGAIN;
+		}
+		lane->spilling = true; //full, or behind others that found it full
+		spin_unlock(&lane->writeq.lock);
+		if (charged) {
+			scull_uncharge(sf->prod, n); //the spill file doesn't count
+		}
+		trace_scull_enqueue(prio, -1, count);
+		return scull_spill_write(lane, from, ttl_ns, nowait);
+	}
+	if (!nowait && !scull_writable(dev, lane, n)) {
+		scull_expire_arm(lane); //wake us when what's in the way expires
+	}
+	do {
+		ret = scull_wait(dev, &lane->writeq, scull_writable, lane, n, &sf->wspin, true, nowait);
+	} while (ret == 0 && !scull_make_room(dev, lane, n)); //a reader got to what we'd drop
+	if (ret != 0) { //interrupted or would block
+		spin_unlock(&lane->writeq.lock);
+		if (charged) {
+			scull_uncharge(sf->prod, n);
+		}
+		if (zc) {
+			kref_put(&zc->ref, scull_zc_free);
+		}
+		return ret;
+	}
+	slot = lane->in; //claim the slots
+	for (i = 0; i < n; i++) {
+		scull_slot(lane, scull_advance(slot, i))->state = SCULL_SLOT_WRITING;
 	}
+	smp_store_release(&lane->in, scull_advance(slot, n)); //the WRITING states first, see scull_cur_advance()
+	hdr = scull_slot(lane, slot);
+	hdr->seq = lane->seq++; //in the order they get into the lane
+	if (scull_writable(dev, lane, 1)) {
+		wake_up_locked(&lane->writeq); //room for the next writer too
+	}
+	spin_unlock(&lane->writeq.lock);
+	atomic_add(n, &dev->used);
+	scull_water(dev);
 
-	if (((char*)mqueuei) > (start + ((scull_fifo_size-1) * (sizeof(size_t)+scull_fifo_elemsz)))) {
-		mqueuei = start; //wrap around the queue if at the last element of queue
+	hdr->flags = 0;
+	hdr->nslots = n;
+	hdr->len = count; //add length of next elem to the queue
+	hdr->prod = NULL;
+	if (charged) { //the reservation is the message's now
+		kref_get(&sf->prod->ref);
+		hdr->prod = sf->prod;
+	}
+	if (zc) {
+		kref_get(&zc->ref); //the slot's reference
+		hdr->flags = SCULL_HDR_ZCOPY;
+		*scull_zc_of(hdr) = zc;
+	} else if (scull_copy_in(lane, slot, from, count) != 0) {
+		hdr->flags = SCULL_HDR_DEAD; //the slot is ours, it still has to be handed over
+		ret = -EFAULT; //return this if copy from user didn't work properly
 	}
+	hdr->stamp = ktime_get_ns();
+	hdr->deadline = ttl_ns ? hdr->stamp + ttl_ns : 0;
+	hdr->tgid = task_tgid_nr(current);
+	trace_scull_enqueue(prio, slot, count);
 
-	else {
-		mqueuei = mqueuei + scull_fifo_elemsz; // go to where len of next message will be written in queue
+	scull_publish(dev, hdr);
+
+	if (zc) { //our pages are in the queue, wait for every group to copy them out
+		ret = wait_for_completion_killable(&zc->done);
+		kref_put(&zc->ref, scull_zc_free);
 	}
-	mutex_unlock(&mux); //unlock mutex
-	up(&reade); //tell read that queue added a message
-	return count;
+	return ret ? ret : count;
 }
 
 /*
- * The ioctl() implementation
+ * BURST: b.count messages in one call, each one written in order just
+ * as write() would (so blocking, spill, zero-copy and the rest apply).
+ * Stops at the first one that fails, or at a signal once something has
+ * gone in. Returns the number written, also stored in b.done.
  */
-static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long scull_burst(struct file *filp, struct scull_burst __user *arg)
+{
+	struct scull_msg __user *umsg;
+	struct scull_burst b;
+	struct scull_msg m;
+	struct kiocb kiocb;
+	struct iov_iter it;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	if (copy_from_user(&b, arg, sizeof(b)))
+		return -EFAULT;
+	if (b.count == 0)
+		return -EINVAL;
+	umsg = u64_to_user_ptr(b.msgs);
+
+	for (i = 0; i < b.count; i++) {
+		if (i > 0 && signal_pending(current))
+			break; //what went in stays in, the caller sees a short count
+		if (copy_from_user(&m, &umsg[i], sizeof(m))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (m.len > MAX_RW_COUNT) {
+			ret = -EMSGSIZE; //import_ubuf() would cut it short
+			break;
+		}
+		ret = import_ubuf(ITER_SOURCE, u64_to_user_ptr(m.buf), m.len, &it);
+		if (ret != 0)
+			break;
+		init_sync_kiocb(&kiocb, filp);
+		ret = scull_write(&kiocb, &it);
+		if (ret < 0)
+			break;
+	}
+
+	if (i == 0) //nothing to show for it
+		return ret;
+	if (put_user(i, &arg->done))
+		return -EFAULT;
+	return i;
+}
+
+/*
+ * TCOMMIT: let go of the oldest @n messages in the window, all of them
+ * if @n is 0. Returns how many are left.
+ */
+static long scull_commit(struct scull_dev *dev, struct scull_file *sf, unsigned long n)
+{
+	struct scull_peek *pk = READ_ONCE(sf->peek_win);
+	wait_queue_head_t *rq = &dev->group[sf->group].readq;
+	struct scull_msgref *m;
+	unsigned int i, k;
+
+	if (pk == NULL)
+		return -EINVAL;
+	mutex_lock(&pk->lock);
+	spin_lock(&rq->lock);
+	k = (n == 0 || n > pk->count) ? pk->count : n;
+	spin_unlock(&rq->lock);
+
+	//readers only add at the other end, these k stay put
+	for (i = 0; i < k; i++) {
+		m = &pk->msg[(pk->head + i) % SCULL_PEEK_MAX];
+		scull_release_slot(dev, scull_lane(dev, m->lane), m->slot, sf->group);
+	}
+
+	spin_lock(&rq->lock);
+	pk->head = (pk->head + k) % SCULL_PEEK_MAX;
+	pk->count -= k;
+	k = pk->count;
+	spin_unlock(&rq->lock);
+	mutex_unlock(&pk->lock);
+	return k;
+}
+
+static long scull_set_peek(struct scull_file *sf, bool on)
 {
+	struct scull_peek *pk;
+
+	if (on && READ_ONCE(sf->stream))
+		return -EINVAL; //a window holds whole messages
+	if (on && READ_ONCE(sf->priv))
+		return -EINVAL; //nobody else to hand them back to
+	if (on && sf->peek_win == NULL) {
+		pk = kzalloc(sizeof(*pk), GFP_KERNEL_ACCOUNT);
+		if (pk == NULL)
+			return -ENOMEM;
+		mutex_init(&pk->lock);
+		if (cmpxchg(&sf->peek_win, NULL, pk) != NULL)
+			kfree(pk); //another thread beat us to it
+	}
+	WRITE_ONCE(sf->peek, on); //the window stays around until close
+	return 0;
+}
 
-	int err = 0;
+/*
+ * The ioctl() implementation
+ */
+static long scull_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	long spilled = 0;
+	unsigned long q;
+	int err = 0, i;
 	int retval = 0;
     
 	/*
@@ -169,6 +2374,206 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case SCULL_IOCGETELEMSZ:
 		return scull_fifo_elemsz;
 
+	case SCULL_IOCGETMAXMSG:
+		return scull_fifo_maxmsg;
+
+	case SCULL_IOCTSPIN: /* Tell: arg is the spin budget in ns */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM; //the cap is for every fd's waits
+		if (arg > SCULL_SPIN_MAX_NS)
+			return -EINVAL;
+		WRITE_ONCE(dev->spin_max_ns, arg);
+		WRITE_ONCE(sf->rspin.spin_ns, arg); //other fds adapt up to it, or are clamped down
+		WRITE_ONCE(sf->wspin.spin_ns, arg);
+		break;
+
+	case SCULL_IOCQSPIN: /* Query: return it */
+		return dev->spin_max_ns;
+
+	case SCULL_IOCGETLANES:
+		return scull_fifo_lanes;
+
+	case SCULL_IOCTPRIO: /* Tell: lane this fd writes to */
+		if (arg >= scull_fifo_lanes)
+			return -EINVAL;
+		WRITE_ONCE(sf->prio, arg);
+		break;
+
+	case SCULL_IOCQPRIO:
+		return sf->prio;
+
+	case SCULL_IOCQNODE: /* Query: node of the lane our writes go to */
+		return page_to_nid(virt_to_page(scull_wlane(dev, sf->prio)->start));
+
+	case SCULL_IOCGETGROUPS:
+		return scull_fifo_groups;
+
+	case SCULL_IOCTGROUP: /* Tell: consumer group this fd reads for */
+		if (arg >= scull_fifo_groups)
+			return -EINVAL;
+		if (sf->peek_win && READ_ONCE(sf->peek_win->count))
+			return -EBUSY; //the window belongs to the old group
+		WRITE_ONCE(sf->group, arg);
+		break;
+
+	case SCULL_IOCQGROUP:
+		return sf->group;
+
+	case SCULL_IOCTLAG: /* Tell: 1 = our group drops what it lags behind on, 0 = blocks writers */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM; //the group's other readers lose messages too
+		if (arg) {
+			set_bit(sf->group, &dev->drop_mask);
+		} else {
+			clear_bit(sf->group, &dev->drop_mask);
+		}
+		for (i = 0; i < scull_nr_nodes * scull_fifo_lanes; i++)
+			wake_up(&scull_lane(dev, i)->writeq); //blocked writers may drop now
+		break;
+
+	case SCULL_IOCQLAG:
+		return test_bit(sf->group, &dev->drop_mask);
+
+	case SCULL_IOCQDROPS: /* Query: messages our group lost to TLAG */
+		return atomic64_read(&dev->group[sf->group].dropped);
+
+	case SCULL_IOCTPEEK: /* Tell: 1 = reads keep their messages until TCOMMIT */
+		return scull_set_peek(sf, !!arg);
+
+	case SCULL_IOCQPEEK: /* Query: messages read but not committed */
+		return sf->peek_win ? READ_ONCE(sf->peek_win->count) : 0;
+
+	case SCULL_IOCTCOMMIT: /* Tell: commit this many, 0 = all */
+		return scull_commit(dev, sf, arg);
+
+	case SCULL_IOCDRAIN: /* arg points to a struct scull_drain */
+		return scull_drain(filp, (struct scull_drain __user *)arg);
+
+	case SCULL_IOCBURST: /* arg points to a struct scull_burst */
+		return scull_burst(filp, (struct scull_burst __user *)arg);
+
+	case SCULL_IOCQSPILL: /* Query: bytes waiting in the spill files */
+		for (i = 0; i < scull_nr_nodes * scull_fifo_lanes; i++)
+			spilled += scull_spill_used(scull_lane(dev, i));
+		return spilled;
+
+	case SCULL_IOCTWATERHI: /* Tell: high watermark in slots, 0 = off */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM; //one per device
+		return scull_set_water(dev, arg, true);
+
+	case SCULL_IOCQWATERHI:
+		return dev->water_high;
+
+	case SCULL_IOCTWATERLO: /* Tell: low watermark in slots */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+		return scull_set_water(dev, arg, false);
+
+	case SCULL_IOCQWATERLO:
+		return dev->water_low;
+
+	case SCULL_IOCQFILL: /* Query: slots in use */
+		return atomic_read(&dev->used);
+
+	case SCULL_IOCQWATER: /* Query: 1 = over the high watermark */
+		return READ_ONCE(dev->water_over);
+
+	case SCULL_IOCTWATERFD: /* Tell: eventfd for crossings, -1 = none */
+		return scull_set_waterfd(dev, sf, (int)arg);
+
+	case SCULL_IOCTFAIR: /* Tell: starvation limit, 0 = strict priority */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM; //changes the read order for everybody
+		WRITE_ONCE(dev->fair_limit, arg);
+		break;
+
+	case SCULL_IOCQFAIR:
+		return dev->fair_limit;
+
+	case SCULL_IOCTSTREAM: /* Tell: 1 = byte stream, 0 = messages */
+		if (arg && (READ_ONCE(sf->peek) || READ_ONCE(sf->priv)))
+			return -EINVAL;
+		WRITE_ONCE(sf->stream, !!arg);
+		break;
+
+	case SCULL_IOCQSTREAM:
+		return sf->stream;
+
+	case SCULL_IOCTPRIVATE: /* Tell: 1 = this fd gets a queue of its own */
+		if (arg && (READ_ONCE(sf->stream) || READ_ONCE(sf->peek)))
+			return -EINVAL;
+		WRITE_ONCE(sf->priv, !!arg); //the queue itself comes with the first write
+		break;
+
+	case SCULL_IOCQPRIVATE:
+		return sf->priv;
+
+	case SCULL_IOCTZCOPY: /* Tell: smallest write that goes zero-copy */
+		WRITE_ONCE(sf->zcopy_min, arg);
+		break;
+
+	case SCULL_IOCQZCOPY:
+		return sf->zcopy_min;
+
+	case SCULL_IOCTSHARE: /* Tell: slots one producer may hold, 0 = no limit */
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM; //it limits everybody, not just us
+		if (arg > (unsigned long)scull_nr_nodes * scull_fifo_lanes * scull_fifo_size)
+			return -EINVAL;
+		WRITE_ONCE(dev->share, arg);
+		break;
+
+	case SCULL_IOCQSHARE:
+		return dev->share;
+
+	case SCULL_IOCQHELD: /* Query: slots this fd's messages hold */
+		return atomic_read(&sf->prod->held);
+
+	case SCULL_IOCTQUOTA: /* Tell: ring bytes this fd's messages may hold, 0 = no limit */
+		q = READ_ONCE(scull_fifo_quota);
+		if (q && (arg == 0 || arg > q) && !capable(CAP_SYS_RESOURCE))
+			return -EPERM; //lowering our own is fine, raising it past the default isn't
+		WRITE_ONCE(sf->prod->quota, arg);
+		break;
+
+	case SCULL_IOCQQUOTA:
+		return min_t(unsigned long, READ_ONCE(sf->prod->quota), LONG_MAX);
+
+	case SCULL_IOCQQUEUED: /* Query: ring bytes this fd's messages hold */
+		return atomic_long_read(&sf->prod->bytes);
+
+	case SCULL_IOCQOVER: /* Query: writes this fd had refused for the quota */
+		return atomic_long_read(&sf->prod->over);
+
+	case SCULL_IOCTTTL: /* Tell: messages this fd writes expire after arg ns, 0 = never */
+		if (arg > SCULL_TTL_MAX)
+			return -EINVAL; //stamp + ttl would wrap and expire it at once
+		WRITE_ONCE(sf->ttl_ns, arg);
+		break;
+
+	case SCULL_IOCQTTL:
+		return sf->ttl_ns;
+
+	case SCULL_IOCQEXPIRED: /* Query: messages our group never read because they expired */
+		return atomic64_read(&dev->group[sf->group].expired);
+
+	/*
+	 * The same four through a pointer: a Query return is an int in
+	 * userspace, too small for them.
+	 */
+	case SCULL_IOCGTTL:
+		return put_user((u64)READ_ONCE(sf->ttl_ns), (u64 __user *)arg);
+
+	case SCULL_IOCGDROPS:
+		return put_user((u64)atomic64_read(&dev->group[sf->group].dropped), (u64 __user *)arg);
+
+	case SCULL_IOCGEXPIRED:
+		return put_user((u64)atomic64_read(&dev->group[sf->group].expired), (u64 __user *)arg);
+
+	case SCULL_IOCGQUOTA:
+		return put_user((u64)READ_ONCE(sf->prod->quota), (u64 __user *)arg);
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -176,19 +2581,174 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 }
 
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long ret = scull_do_ioctl(filp, cmd, arg);
+
+	trace_scull_ioctl(cmd, arg, ret);
+	return ret;
+}
+
+/*
+ * io_uring: IORING_OP_URING_CMD runs the ioctl in cmd_op, with the
+ * argument in the SQE as a struct scull_uring_cmd, so a batch of them
+ * costs one io_uring_enter(). The ones that may sleep get punted to an
+ * io_uring worker from the inline (non-blocking) attempt.
+ */
+static int scull_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	const struct scull_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		switch (ioucmd->cmd_op) {
+		case SCULL_IOCDRAIN:
+		case SCULL_IOCBURST:
+		case SCULL_IOCTPEEK:
+		case SCULL_IOCTCOMMIT:
+		case SCULL_IOCGTTL: //put_user() may fault
+		case SCULL_IOCGDROPS:
+		case SCULL_IOCGEXPIRED:
+		case SCULL_IOCGQUOTA:
+			return -EAGAIN;
+		}
+	}
+	return scull_ioctl(ioucmd->file, ioucmd->cmd_op, READ_ONCE(cmd->arg));
+}
+
+static __poll_t scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_lane *lane = scull_wlane(dev, READ_ONCE(sf->prio));
+	unsigned int share;
+	__poll_t mask = 0;
+
+	if (READ_ONCE(sf->priv)) {
+		poll_wait(filp, &sf->priv_wq, wait);
+		if (scull_priv_readable(sf))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		if (scull_priv_room(sf, 0))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		return mask;
+	}
+	poll_wait(filp, &dev->group[READ_ONCE(sf->group)].readq, wait);
+	poll_wait(filp, &lane->writeq, wait);
+	if (lane->spill)
+		poll_wait(filp, &lane->spillq, wait);
+	poll_wait(filp, &dev->waterq, wait);
+	poll_wait(filp, &sf->prod->waitq, wait);
+	if (scull_readable(dev, NULL, READ_ONCE(sf->group)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	share = READ_ONCE(dev->share);
+	if (share && !scull_share_room(sf->prod, 1, share))
+		; //our share is used up, never mind the ring
+	else if (scull_writable(dev, lane, 1) || (lane->spill && scull_spill_room(lane, 0)))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	else
+		scull_expire_arm(lane); //so the poll hears about it when the way clears
+	if (READ_ONCE(dev->water_high))
+		mask |= READ_ONCE(dev->water_over) ? EPOLLPRI : EPOLLWRBAND;
+	return mask;
+}
+
 struct file_operations scull_fops = {
 	.owner 		= THIS_MODULE,
 	.unlocked_ioctl = scull_ioctl,
+	.uring_cmd	= scull_uring_cmd,
 	.open 		= scull_open,
 	.release	= scull_release,
-	.read 		= scull_read,
-	.write 		= scull_write,
+	.read_iter	= scull_read,
+	.write_iter	= scull_write,
+	.poll		= scull_poll,
 };
 
 /*
  * Finally, the module stuff
  */
 
+static void scull_free_lanes(void)
+{
+	unsigned int slot;
+	int n, i;
+
+	if (scull_dev.node == NULL)
+		return;
+	for (n = 0; n < scull_nr_nodes; n++) {
+		if (scull_dev.node[n] == NULL)
+			continue;
+		for (i = 0; i < scull_fifo_lanes; i++) {
+			struct scull_lane *lane = &scull_dev.node[n][i];
+
+			if (lane->spill) {
+				cancel_work_sync(&lane->spill_work);
+				fput(lane->spill);
+			}
+			cancel_delayed_work_sync(&lane->expire_work);
+			//messages nobody read may still pin a dead writer's pages, and hold their producer
+			for (slot = 0; slot < scull_fifo_size; slot++) {
+				if (scull_slot_is(lane, slot, SCULL_SLOT_READY))
+					scull_free_slot(&scull_dev, lane, slot);
+			}
+			kfree(lane->start);
+		}
+		kfree(scull_dev.node[n]);
+	}
+	kfree(scull_dev.node);
+	scull_dev.node = NULL;
+}
+
+/* a set of lanes with their rings, all on @nid */
+static struct scull_lane *scull_alloc_lanes(int nid)
+{
+	struct scull_lane *lanes;
+	int i;
+
+	if (nid != NUMA_NO_NODE && !node_state(nid, N_MEMORY))
+		nid = NUMA_NO_NODE; //memoryless node, take what's near
+	lanes = kcalloc_node(scull_fifo_lanes, sizeof(struct scull_lane), GFP_KERNEL_ACCOUNT, nid);
+	if (lanes == NULL)
+		return NULL;
+	for (i = 0; i < scull_fifo_lanes; i++) {
+		struct scull_lane *lane = &lanes[i];
+
+		lane->start = kzalloc_node(scull_fifo_size * SCULL_SLOTSZ, GFP_KERNEL_ACCOUNT, nid);
+		if (lane->start == NULL) {
+			while (i--)
+				kfree(lanes[i].start);
+			kfree(lanes);
+			return NULL;
+		}
+		lane->in = 0; //slot where next message will be added to queue
+		//every group's cursor starts out at slot 0 too, kcalloc zeroed them
+		init_waitqueue_head(&lane->writeq);
+		mutex_init(&lane->spill_lock);
+		init_waitqueue_head(&lane->spillq);
+		INIT_WORK(&lane->spill_work, scull_spill_replay);
+		INIT_DELAYED_WORK(&lane->expire_work, scull_expire_sweep);
+	}
+	return lanes;
+}
+
+/* an unlinked spill file in scull_spill_dir for every lane */
+static int scull_spill_open(void)
+{
+	struct scull_lane *lane;
+	int l;
+
+	for (l = 0; l < scull_nr_nodes * scull_fifo_lanes; l++) {
+		lane = scull_lane(&scull_dev, l);
+		lane->spill = filp_open(scull_spill_dir, O_TMPFILE | O_RDWR | O_LARGEFILE, 0600);
+		if (IS_ERR(lane->spill)) {
+			int err = PTR_ERR(lane->spill);
+
+			lane->spill = NULL;
+			printk(KERN_WARNING "scull: can't spill to %s (%d)\n", scull_spill_dir, err);
+			return err;
+		}
+	}
+	return 0;
+}
+
 /*
  * The cleanup function is used to handle initialization failures as well.
  * Thefore, it must be careful to work correctly even if some of the items
@@ -197,31 +2757,116 @@ struct file_operations scull_fops = {
 void scull_cleanup_module(void)
 {
 	dev_t devno = MKDEV(scull_major, scull_minor);
+	struct scull_peek *pk, *tmp;
+	int g;
 
 	/* TODO: free FIFO safely here */
 
+	debugfs_remove_recursive(scull_debugfs);
+
 	/* Get rid of the char dev entry */
-	cdev_del(&scull_cdev);
+	cdev_del(&scull_dev.cdev);
 
 	/* cleanup_module is never called if registering failed */
 	unregister_chrdev_region(devno, 1);
-	kfree(start); //free queue
+
+	//windows left over from closed peek readers
+	for (g = 0; g < scull_fifo_groups; g++) {
+		list_for_each_entry_safe(pk, tmp, &scull_dev.group[g].retry, node)
+			kfree(pk);
+	}
+	scull_free_lanes(); //free queue
+	flush_work(&scull_zc_work); //the zero-copy messages it let go of
 
 }
 
 int scull_init_module(void)
 {
-	int result;
+	int result, n, lane_bytes;
 	dev_t dev = 0;
 
+	if (scull_fifo_lanes < 1 || scull_fifo_lanes > SCULL_FIFO_LANES_MAX) {
+		printk(KERN_WARNING "scull: need 1..%d lanes\n", SCULL_FIFO_LANES_MAX);
+		return -EINVAL;
+	}
+
+	if (scull_fifo_groups < 1 || scull_fifo_groups > SCULL_FIFO_GROUPS_MAX) {
+		printk(KERN_WARNING "scull: need 1..%d consumer groups\n", SCULL_FIFO_GROUPS_MAX);
+		return -EINVAL;
+	}
+
+	if (scull_fifo_node != NUMA_NO_NODE &&
+	    (scull_fifo_node < 0 || scull_fifo_node >= nr_node_ids || !node_online(scull_fifo_node))) {
+		printk(KERN_WARNING "scull: node %d is not online\n", scull_fifo_node);
+		return -EINVAL;
+	}
+	scull_nr_nodes = scull_fifo_pernode ? nr_node_ids : 1;
+
+	if (scull_fifo_size < 1 || scull_fifo_elemsz < 1) {
+		printk(KERN_WARNING "scull: need at least one slot of at least one byte\n");
+		return -EINVAL;
+	}
+#ifdef SCULL_FIFO_SIZE_FIXED
+	if (scull_fifo_size != SCULL_FIFO_SIZE_FIXED) {
+		printk(KERN_WARNING "scull: built for scull_fifo_size=%d\n", SCULL_FIFO_SIZE_FIXED);
+		return -EINVAL;
+	}
+#else
+	if (is_power_of_2(scull_fifo_size))
+		static_branch_enable(&scull_fifo_pow2);
+#endif
+#ifdef SCULL_FIFO_ELEMSZ_FIXED
+	if (scull_fifo_elemsz != SCULL_FIFO_ELEMSZ_FIXED) {
+		printk(KERN_WARNING "scull: built for scull_fifo_elemsz=%d\n", SCULL_FIFO_ELEMSZ_FIXED);
+		return -EINVAL;
+	}
+#else
+	scull_slotsz = ALIGN(sizeof(struct scull_hdr) + scull_fifo_elemsz, sizeof(u64));
+#endif
+
+	if (check_mul_overflow(scull_fifo_size, scull_fifo_elemsz, &lane_bytes)) {
+		printk(KERN_WARNING "scull: scull_fifo_size * scull_fifo_elemsz doesn't fit in an int\n");
+		return -EINVAL; //GETMAXMSG and the message lengths are ints
+	}
+	if (scull_fifo_maxmsg <= 0 || scull_fifo_maxmsg > lane_bytes) {
+		scull_fifo_maxmsg = lane_bytes; //a message can't be bigger than a lane
+	}
 
-	//initiaize the message queue
-	start = (char*) kmalloc(scull_fifo_size * (sizeof(size_t)+scull_fifo_elemsz), GFP_KERNEL);
-	if (start == NULL) { //return on error
+	//initiaize the message queues, all slots start out FREE
+	scull_dev.node = kcalloc(scull_nr_nodes, sizeof(struct scull_lane *), GFP_KERNEL);
+	if (scull_dev.node == NULL) { //return on error
 		return -ENOMEM;
 	}
-	mqueueo = start; //make two void pointers, one for where new message will be added to queue
-	mqueuei = start; //and one where next message will be read from queue
+	for (n = 0; n < scull_nr_nodes; n++) {
+		scull_dev.node[n] = scull_alloc_lanes(scull_fifo_pernode ? n : scull_fifo_node);
+		if (scull_dev.node[n] == NULL) {
+			scull_free_lanes();
+			return -ENOMEM;
+		}
+	}
+	for (n = 0; n < scull_fifo_groups; n++) {
+		init_waitqueue_head(&scull_dev.group[n].readq);
+		INIT_LIST_HEAD(&scull_dev.group[n].retry);
+	}
+	init_waitqueue_head(&scull_dev.waterq); //watermarks start out off
+	INIT_LIST_HEAD(&scull_dev.water_fds);
+	spin_lock_init(&scull_dev.prod_lock);
+	INIT_LIST_HEAD(&scull_dev.prods);
+
+	if (scull_spill_dir) {
+		if (scull_spill_max < sizeof(struct scull_spill_rec) + scull_fifo_maxmsg) {
+			printk(KERN_WARNING "scull: scull_spill_max can't hold a message\n");
+			scull_free_lanes();
+			return -EINVAL;
+		}
+		result = scull_spill_open();
+		if (result) {
+			scull_free_lanes();
+			return result;
+		}
+	}
+
+	scull_dev.spin_max_ns = min(scull_spin_max_ns, SCULL_SPIN_MAX_NS);
 
 	/*
 	 * Get a range of minor numbers to work with, asking for a dynamic
@@ -236,12 +2881,13 @@ int scull_init_module(void)
 	}
 	if (result < 0) {
 		printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
+		scull_free_lanes();
 		return result;
 	}
 
-	cdev_init(&scull_cdev, &scull_fops);
-	scull_cdev.owner = THIS_MODULE;
-	result = cdev_add (&scull_cdev, dev, 1);
+	cdev_init(&scull_dev.cdev, &scull_fops);
+	scull_dev.cdev.owner = THIS_MODULE;
+	result = cdev_add (&scull_dev.cdev, dev, 1);
 	/* Fail gracefully if need be */
 	if (result) {
 		printk(KERN_NOTICE "Error %d adding scull character device", result);
@@ -250,11 +2896,14 @@ int scull_init_module(void)
 
 	/* TODO: allocate FIFO correctly here */
 
-	printk(KERN_INFO "scull: FIFO SIZE=%u, ELEMSZ=%u\n", scull_fifo_size, scull_fifo_elemsz);
+	printk(KERN_INFO "scull: FIFO SIZE=%u, ELEMSZ=%u, LANES=%u, MAXMSG=%u, NODES=%u, GROUPS=%u\n",
+	       scull_fifo_size, scull_fifo_elemsz, scull_fifo_lanes, scull_fifo_maxmsg, scull_nr_nodes,
+	       scull_fifo_groups);
 
-	//initialize semaphores.
-	sema_init(&reade, 0);
-	sema_init(&writee, scull_fifo_size);
+	//latency histogram lives in <debugfs>/scull/latency
+	scull_debugfs = debugfs_create_dir("scull", NULL);
+	debugfs_create_file("latency", 0644, scull_debugfs, NULL, &scull_lat_fops);
+	debugfs_create_file("quota", 0444, scull_debugfs, &scull_dev, &scull_quota_fops);
 
 	return 0; /* succeed */
 
@@ -24,11 +24,6 @@
 #define SCULL_MAJOR 0   /* dynamic major by default */
 #endif
 
-//init global message queue
-void* mqueuei; //contains addy where next message will be added to queue
-void* mqueueo; //contains addy where next message will be read from queue
-char* start; //will always contain the start addy of queue.
-
 /*
  * SCULL_FIFO_SIZE_DEFAULT
  */
@@ -43,6 +38,67 @@ char* start; //will always contain the start addy of queue.
 #define SCULL_FIFO_ELEMSZ_DEFAULT 256
 #endif
 
+/*
+ * SCULL_FIFO_LANES_DEFAULT: priority lanes, each one has its own
+ * SCULL_FIFO_SIZE slots
+ */
+#ifndef SCULL_FIFO_LANES_DEFAULT
+#define SCULL_FIFO_LANES_DEFAULT 1
+#endif
+
+#define SCULL_FIFO_LANES_MAX 8
+
+/*
+ * SCULL_FIFO_GROUPS_DEFAULT: consumer groups, each one reads every
+ * message
+ */
+#ifndef SCULL_FIFO_GROUPS_DEFAULT
+#define SCULL_FIFO_GROUPS_DEFAULT 1
+#endif
+
+#define SCULL_FIFO_GROUPS_MAX 8
+
+/*
+ * SCULL_RR_WINDOW: messages past its cursor a reader looks through to
+ * take turns between producers while TSHARE is on
+ */
+#ifndef SCULL_RR_WINDOW
+#define SCULL_RR_WINDOW 64
+#endif
+
+/*
+ * SCULL_PEEK_MAX: messages a peek-mode fd can hold uncommitted
+ */
+#ifndef SCULL_PEEK_MAX
+#define SCULL_PEEK_MAX 64
+#endif
+
+/*
+ * SCULL_ZCOPY_MAXMSG: largest write on the zero-copy path
+ */
+#ifndef SCULL_ZCOPY_MAXMSG
+#define SCULL_ZCOPY_MAXMSG (16 * 1024 * 1024)
+#endif
+
+/*
+ * SCULL_TTL_MAX: longest TTL in ns, about 146 years
+ */
+#define SCULL_TTL_MAX (1ULL << 62)
+
+/*
+ * SCULL_LAT_BUCKETS: log2 buckets of the queueing delay histogram
+ */
+#ifndef SCULL_LAT_BUCKETS
+#define SCULL_LAT_BUCKETS 40
+#endif
+
+/*
+ * SCULL_SPIN_MAX_NS: upper limit for the spin-before-sleep budget
+ */
+#ifndef SCULL_SPIN_MAX_NS
+#define SCULL_SPIN_MAX_NS 1000000U
+#endif
+
 /*
  * Ioctl definitions
  */
@@ -54,12 +110,223 @@ char* start; //will always contain the start addy of queue.
 
 /*
  * GETELEMSZ means "Get Element Size"
+ * GETMAXMSG means "Get largest message size", longer writes fail with
+ *           EMSGSIZE. Messages longer than ELEMSZ take several slots
  * SETSIZE   means "Set FIFO size (# of elements)" (unused)
+ * TSPIN     means "Tell max spin before sleeping" in ns, 0 disables it.
+ *           Needs CAP_SYS_RESOURCE
+ * QSPIN     means "Query max spin before sleeping"
+ * GETLANES  means "Get number of priority lanes"
+ * TPRIO     means "Tell priority": lane this fd writes to, 0 is the lowest
+ * QPRIO     means "Query priority" of this fd
+ * TFAIR     means "Tell fairness": after a lane with messages has been
+ *           passed over this many times for higher lanes, it's read
+ *           next. 0 means strict priority. Needs CAP_SYS_RESOURCE
+ * QFAIR     means "Query fairness"
+ * TSTREAM   means "Tell stream mode" of this fd: 1 makes read() behave
+ *           like a pipe, returning up to count bytes across messages
+ *           and leaving what doesn't fit queued. 0 (the default) reads
+ *           one message per call and drops what doesn't fit
+ * QSTREAM   means "Query stream mode" of this fd
+ * TZCOPY    means "Tell zero-copy threshold" of this fd: writes of at
+ *           least this many bytes (up to SCULL_ZCOPY_MAXMSG) pin the
+ *           writer's pages instead of copying them into the FIFO, and
+ *           write() returns once a reader has copied the message out.
+ *           That blocks, so a non-blocking write too big for the FIFO
+ *           without it fails with EMSGSIZE (io_uring gets EAGAIN and
+ *           retries it from a worker). While the lane is spilling such a
+ *           write waits for the spill file to drain. 0 (the default)
+ *           turns it off
+ * QZCOPY    means "Query zero-copy threshold" of this fd
+ * QNODE     means "Query node": NUMA node of the ring this fd's writes
+ *           go to. With scull_fifo_pernode that's the caller's node
+ * QSPILL    means "Query spill": bytes of messages waiting in the
+ *           overflow files (scull_spill_dir) to get back into the FIFO
+ * GETGROUPS means "Get number of consumer groups". Every group reads
+ *           every message, readers in the same group share them
+ * TGROUP    means "Tell group" this fd reads for, 0 (the default) .. GROUPS-1
+ * QGROUP    means "Query group" of this fd
+ * TLAG      means "Tell lag policy" of this fd's group: 0 (the default)
+ *           makes writers wait for it, 1 lets a writer that needs the
+ *           slot drop the message for it instead. Needs CAP_SYS_RESOURCE
+ * QLAG      means "Query lag policy" of this fd's group
+ * QDROPS    means "Query drops": messages this fd's group lost that way
+ * TPEEK     means "Tell peek mode" of this fd: 1 makes read() keep the
+ *           message in the FIFO until it is committed. If the fd is
+ *           closed first, the group gets the message again. Up to
+ *           SCULL_PEEK_MAX may be outstanding, read() then fails with
+ *           ENOBUFS. Not with TSTREAM
+ * QPEEK     means "Query peek": messages read but not committed yet
+ * TCOMMIT   means "Tell commit": let go of the oldest arg messages read
+ *           in peek mode, 0 for all of them. Returns how many are left
+ * DRAIN     reads up to max messages at once into a struct scull_drain:
+ *           a struct scull_desc for each at desc and their payloads
+ *           packed back to back at buf. Blocks like read() for the
+ *           first one, stops at the first one that doesn't fit. Returns
+ *           the number of messages. Every message carries a sequence
+ *           number per lane, so a gap means messages were dropped
+ * BURST     writes count messages at once from a struct scull_burst:
+ *           each struct scull_msg at msgs goes in as its own write()
+ *           would, in order. Stops at the first one that fails and
+ *           returns the number written, also in done; the error only
+ *           if it was the first
+ * TWATERHI  means "Tell high watermark": once this many slots (over all
+ *           lanes) are in use the FIFO is "over" until the fill drops
+ *           back to the low watermark. 0 (the default) turns it off.
+ *           Must be above the low one. Needs CAP_SYS_RESOURCE
+ * QWATERHI  means "Query high watermark"
+ * TWATERLO  means "Tell low watermark", below the high one. Needs
+ *           CAP_SYS_RESOURCE
+ * QWATERLO  means "Query low watermark"
+ * QFILL     means "Query fill": slots in use right now, over all lanes
+ * QWATER    means "Query watermark state": 1 while over
+ * TWATERFD  means "Tell watermark eventfd": arg is an eventfd that gets
+ *           signalled every time the FIFO goes over or comes back
+ *           (QWATER says which), -1 to stop. poll() reports EPOLLPRI
+ *           while over and EPOLLWRBAND while not, when watermarks are on
+ * TTTL      means "Tell time to live" of this fd, in ns: messages it
+ *           writes expire that long after they are queued. Readers skip
+ *           expired messages, and writers facing a full ring take them
+ *           back. 0 (the default) means they never expire. At most
+ *           SCULL_TTL_MAX
+ * QTTL      means "Query time to live" of this fd
+ * QEXPIRED  means "Query expired": messages this fd's group never got
+ *           to because they expired first
+ * TSHARE    means "Tell share": slots of the FIFO one open file's
+ *           messages may hold at once, so one fast writer can't fill it
+ *           for everybody. A writer over its share waits for its own
+ *           messages to be read (EAGAIN if nonblocking). While it's
+ *           on, message reads take turns between the open files that
+ *           wrote what's queued (within SCULL_RR_WINDOW messages of a
+ *           lane), instead of reading one writer's backlog first.
+ *           Each writer's own messages stay in order, but DRAIN's
+ *           sequence numbers no longer come out sorted. 0 (the default)
+ *           means no limit. Needs CAP_SYS_RESOURCE
+ * QSHARE    means "Query share"
+ * QHELD     means "Query held": slots this fd's messages hold right now
+ * TQUOTA    means "Tell quota": bytes of the ring (whole slots) this
+ *           fd's messages may hold. A write that would go over fails
+ *           with EDQUOT. Starts out at the scull_fifo_quota module
+ *           parameter; going over that (or to 0, no limit) takes
+ *           CAP_SYS_RESOURCE
+ * QQUOTA    means "Query quota"
+ * QQUEUED   means "Query queued": ring bytes this fd's messages hold
+ * QOVER     means "Query over": writes this fd had refused with EDQUOT.
+ *           <debugfs>/scull/quota lists all of these for every open fd
+ * TPRIVATE  means "Tell private mode" of this fd: 1 makes its write(),
+ *           read(), DRAIN and poll() use a queue of its own instead of
+ *           the FIFO, so only this fd (and its dup()s) sees what it
+ *           writes. The queue is as big as one lane and gets allocated
+ *           by the first write. Priority, group, TTL, zero-copy, share,
+ *           quota, spill and watermarks don't apply to it, and DRAIN
+ *           reports every message as lane 0. 0 (the default) goes back
+ *           to the FIFO; messages left in the private queue wait there
+ *           for TPRIVATE 1 or close(). Not with TSTREAM or TPEEK
+ * QPRIVATE  means "Query private mode" of this fd
+ * GTTL      means "Get time to live": QTTL through a pointer to an
+ *           unsigned long long. ioctl() returns an int, so QTTL only
+ *           works up to about 2 s
+ * GDROPS    means "Get drops", QDROPS through a pointer, likewise
+ * GEXPIRED  means "Get expired", QEXPIRED through a pointer
+ * GQUOTA    means "Get quota", QQUOTA through a pointer
  */
 #define SCULL_IOCGETELEMSZ _IO(SCULL_IOC_MAGIC,  1)
 #define SCULL_IOCSETSIZE   _IO(SCULL_IOC_MAGIC,  2)
+#define SCULL_IOCTSPIN     _IO(SCULL_IOC_MAGIC,  3)
+#define SCULL_IOCQSPIN     _IO(SCULL_IOC_MAGIC,  4)
+#define SCULL_IOCGETLANES  _IO(SCULL_IOC_MAGIC,  5)
+#define SCULL_IOCTPRIO     _IO(SCULL_IOC_MAGIC,  6)
+#define SCULL_IOCQPRIO     _IO(SCULL_IOC_MAGIC,  7)
+#define SCULL_IOCTFAIR     _IO(SCULL_IOC_MAGIC,  8)
+#define SCULL_IOCQFAIR     _IO(SCULL_IOC_MAGIC,  9)
+#define SCULL_IOCTSTREAM   _IO(SCULL_IOC_MAGIC, 10)
+#define SCULL_IOCQSTREAM   _IO(SCULL_IOC_MAGIC, 11)
+#define SCULL_IOCGETMAXMSG _IO(SCULL_IOC_MAGIC, 12)
+#define SCULL_IOCTZCOPY    _IO(SCULL_IOC_MAGIC, 13)
+#define SCULL_IOCQZCOPY    _IO(SCULL_IOC_MAGIC, 14)
+#define SCULL_IOCQNODE     _IO(SCULL_IOC_MAGIC, 15)
+#define SCULL_IOCQSPILL    _IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_IOCGETGROUPS _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_IOCTGROUP    _IO(SCULL_IOC_MAGIC, 18)
+#define SCULL_IOCQGROUP    _IO(SCULL_IOC_MAGIC, 19)
+#define SCULL_IOCTLAG      _IO(SCULL_IOC_MAGIC, 20)
+#define SCULL_IOCQLAG      _IO(SCULL_IOC_MAGIC, 21)
+#define SCULL_IOCQDROPS    _IO(SCULL_IOC_MAGIC, 22)
+#define SCULL_IOCTPEEK     _IO(SCULL_IOC_MAGIC, 23)
+#define SCULL_IOCQPEEK     _IO(SCULL_IOC_MAGIC, 24)
+#define SCULL_IOCTCOMMIT   _IO(SCULL_IOC_MAGIC, 25)
+#define SCULL_IOCDRAIN     _IOWR(SCULL_IOC_MAGIC, 26, struct scull_drain)
+#define SCULL_IOCTWATERHI  _IO(SCULL_IOC_MAGIC, 27)
+#define SCULL_IOCQWATERHI  _IO(SCULL_IOC_MAGIC, 28)
+#define SCULL_IOCTWATERLO  _IO(SCULL_IOC_MAGIC, 29)
+#define SCULL_IOCQWATERLO  _IO(SCULL_IOC_MAGIC, 30)
+#define SCULL_IOCQFILL     _IO(SCULL_IOC_MAGIC, 31)
+#define SCULL_IOCQWATER    _IO(SCULL_IOC_MAGIC, 32)
+#define SCULL_IOCTWATERFD  _IO(SCULL_IOC_MAGIC, 33)
+#define SCULL_IOCTTTL      _IO(SCULL_IOC_MAGIC, 34)
+#define SCULL_IOCQTTL      _IO(SCULL_IOC_MAGIC, 35)
+#define SCULL_IOCQEXPIRED  _IO(SCULL_IOC_MAGIC, 36)
+#define SCULL_IOCTSHARE    _IO(SCULL_IOC_MAGIC, 37)
+#define SCULL_IOCQSHARE    _IO(SCULL_IOC_MAGIC, 38)
+#define SCULL_IOCQHELD     _IO(SCULL_IOC_MAGIC, 39)
+#define SCULL_IOCTQUOTA    _IO(SCULL_IOC_MAGIC, 40)
+#define SCULL_IOCQQUOTA    _IO(SCULL_IOC_MAGIC, 41)
+#define SCULL_IOCQQUEUED   _IO(SCULL_IOC_MAGIC, 42)
+#define SCULL_IOCQOVER     _IO(SCULL_IOC_MAGIC, 43)
+#define SCULL_IOCTPRIVATE  _IO(SCULL_IOC_MAGIC, 44)
+#define SCULL_IOCQPRIVATE  _IO(SCULL_IOC_MAGIC, 45)
+#define SCULL_IOCGTTL      _IOR(SCULL_IOC_MAGIC, 46, unsigned long long)
+#define SCULL_IOCGDROPS    _IOR(SCULL_IOC_MAGIC, 47, unsigned long long)
+#define SCULL_IOCGEXPIRED  _IOR(SCULL_IOC_MAGIC, 48, unsigned long long)
+#define SCULL_IOCGQUOTA    _IOR(SCULL_IOC_MAGIC, 49, unsigned long long)
+#define SCULL_IOCBURST     _IOWR(SCULL_IOC_MAGIC, 50, struct scull_burst)
+
+/*
+ * A message as DRAIN returns it
+ */
+struct scull_desc {
+	unsigned long long seq;		/* per lane, one up from the last message */
+	unsigned long long stamp;	/* enqueue time, CLOCK_MONOTONIC ns */
+	unsigned long long offset;	/* of the payload in scull_drain.buf */
+	unsigned int len;		/* bytes of payload */
+	unsigned int lane;		/* it came through */
+	int tgid;			/* of the writer */
+	unsigned int flags;		/* SCULL_DESC_* */
+};
+
+#define SCULL_DESC_TRUNC 0x1	/* payload cut short, buf was too small */
+
+struct scull_drain {
+	unsigned long long desc;	/* in: struct scull_desc[max] */
+	unsigned long long buf;		/* in: payload area */
+	unsigned long long buflen;	/* in: its size */
+	unsigned int max;		/* in: messages wanted */
+	unsigned int count;		/* out: messages returned */
+};
+
+/*
+ * A message for BURST
+ */
+struct scull_msg {
+	unsigned long long buf;		/* payload */
+	unsigned long long len;		/* bytes of it */
+};
+
+struct scull_burst {
+	unsigned long long msgs;	/* in: struct scull_msg[count] */
+	unsigned int count;		/* in: messages to write */
+	unsigned int done;		/* out: messages written */
+};
+
+/*
+ * IORING_OP_URING_CMD: cmd_op is one of the above, the SQE's cmd area
+ * holds the ioctl argument
+ */
+struct scull_uring_cmd {
+	unsigned long long arg;
+};
 
 /* Do not forget to modify this macro if you add new commands! */
-#define SCULL_IOC_MAXNR 2
+#define SCULL_IOC_MAXNR 50
 
 #endif /* _SCULL_H_ */
@@ -0,0 +1,148 @@
+/*
+ * scull_trace.h -- tracepoints for the scull FIFO
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/scull/enable
+ * or
+ *   perf trace -e 'scull:*'
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* a message was added to the queue, slot -1 if it went to the spill file */
+TRACE_EVENT(scull_enqueue,
+
+	TP_PROTO(int lane, int slot, size_t len),
+
+	TP_ARGS(lane, slot, len),
+
+	TP_STRUCT__entry(
+		__field(int,	lane)
+		__field(int,	slot)
+		__field(size_t,	len)
+	),
+
+	TP_fast_assign(
+		__entry->lane	= lane;
+		__entry->slot	= slot;
+		__entry->len	= len;
+	),
+
+	TP_printk("lane=%d slot=%d len=%zu",
+		  __entry->lane, __entry->slot, __entry->len)
+);
+
+/* a message was removed, delay is its queueing time in ns */
+TRACE_EVENT(scull_dequeue,
+
+	TP_PROTO(int lane, int slot, size_t len, u64 delay),
+
+	TP_ARGS(lane, slot, len, delay),
+
+	TP_STRUCT__entry(
+		__field(int,	lane)
+		__field(int,	slot)
+		__field(size_t,	len)
+		__field(u64,	delay)
+	),
+
+	TP_fast_assign(
+		__entry->lane	= lane;
+		__entry->slot	= slot;
+		__entry->len	= len;
+		__entry->delay	= delay;
+	),
+
+	TP_printk("lane=%d slot=%d len=%zu delay=%llu",
+		  __entry->lane, __entry->slot, __entry->len, __entry->delay)
+);
+
+DECLARE_EVENT_CLASS(scull_wait,
+
+	TP_PROTO(bool write),
+
+	TP_ARGS(write),
+
+	TP_STRUCT__entry(
+		__field(bool,	write)
+	),
+
+	TP_fast_assign(
+		__entry->write	= write;
+	),
+
+	TP_printk("%s", __entry->write ? "writer" : "reader")
+);
+
+/* the queue was full (writer) or empty (reader), about to sleep */
+DEFINE_EVENT(scull_wait, scull_block,
+	TP_PROTO(bool write),
+	TP_ARGS(write)
+);
+
+/* a task that blocked got its slot or message */
+DEFINE_EVENT(scull_wait, scull_wake,
+	TP_PROTO(bool write),
+	TP_ARGS(write)
+);
+
+/* part of a message was dropped because it didn't fit */
+TRACE_EVENT(scull_truncate,
+
+	TP_PROTO(bool write, size_t len, size_t kept),
+
+	TP_ARGS(write, len, kept),
+
+	TP_STRUCT__entry(
+		__field(bool,	write)
+		__field(size_t,	len)
+		__field(size_t,	kept)
+	),
+
+	TP_fast_assign(
+		__entry->write	= write;
+		__entry->len	= len;
+		__entry->kept	= kept;
+	),
+
+	TP_printk("%s len=%zu kept=%zu",
+		  __entry->write ? "write" : "read",
+		  __entry->len, __entry->kept)
+);
+
+TRACE_EVENT(scull_ioctl,
+
+	TP_PROTO(unsigned int cmd, unsigned long arg, long ret),
+
+	TP_ARGS(cmd, arg, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	cmd)
+		__field(unsigned long,	arg)
+		__field(long,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->cmd	= cmd;
+		__entry->arg	= arg;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("nr=%u arg=0x%lx ret=%ld",
+		  _IOC_NR(__entry->cmd), __entry->arg, __entry->ret)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
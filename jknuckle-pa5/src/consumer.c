@@ -5,9 +5,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/wait.h>
 
 #include "scull.h"
+#include "scull_client.h"
+#include "loadgen.h"
 
 #define CDEV_NAME "/dev/scull"
 #define MAX_CONCURRENCY 20
@@ -15,38 +18,40 @@
 /* Command-line option for concurrency */
 static int g_concurrency = 0;
 
+/* Options for the t and f load generators */
+static struct loadgen g_lg;
+
 static void usage(const char *cmd) {
 	printf("Usage: %s <command>\n"
 	       "Commands:\n"
 	       "  p <int>    Use <int> processes to concurrently consume data\n"
 	       "                  MIN: 1, MAX: %d\n"
-	       "  h          Print this message\n",
-	       cmd, MAX_CONCURRENCY);
+	       "  t <int> [opts]  Use <int> threads to %s data until done\n"
+	       "  f <int> [opts]  The same with <int> pre-forked processes\n"
+	       "                  MIN: 1, MAX: %d\n"
+	       "  h          Print this message\n"
+	       "Options for t and f:\n"
+	       "  -n <int>   Messages per worker (default %d)\n"
+	       "  -d <secs>  Run for <secs> instead of a message count\n"
+	       "  -c <cpus>  Pin worker i to the i-th CPU of a list like 0,2,4-7\n"
+	       "  -b <int>   Messages per syscall, reads and writes (default 1)\n",
+	       cmd, MAX_CONCURRENCY, "consume", LOADGEN_WORKERS_MAX, LOADGEN_COUNT_DEFAULT);
 }
 
-static int do_procs(int fd) {
+static int do_procs(scull_client *c) {
 	int i, status, ret = 0;
 	pid_t pid;
-	char* buf; //cuz I'm dynamically allocating buffer
-	int count; //counts size of message read from queue
+	const char *msg; //points into the client's batch, no copy
+	ssize_t count; //counts size of message read from queue
 
 	for(i = 0; i < g_concurrency; i++) {
 		pid = fork();
 		if(pid == 0) {
-			size_t max_size;
-			max_size = ioctl(fd, SCULL_IOCGETELEMSZ); //gives maximum size a message can be that's getting read from queue
-			buf = (char*) malloc(max_size); //allocate buf on heap
-			if((count = read(fd, buf, max_size)) < 0) { //read from /dev/scull via driver and queue
-				free(buf); //must free cuz function returns
+			if((count = scull_recv(c, &msg, NULL)) < 0) { //read from /dev/scull via driver and queue
 				perror("read");//prints error message
 				exit(-1);
 			}
-			if(count) {
-				//will give issues if count == max_size
-				buf[count] = '\0'; //adds null terminator to message
-				printf("read: %s\n", buf); //print message
-				free(buf); //free buf
-			}
+			printf("read: %.*s\n", (int)count, msg); //not '\0' terminated, print count bytes
 
 			exit(EXIT_SUCCESS);
 		} else if(pid < 0) {
@@ -62,6 +67,13 @@ static int do_procs(int fd) {
 	return ret;
 }
 
+/* one message for the t and f workers, looked at but not printed */
+static int consume_one(scull_client *c, void *arg) {
+	const char *msg;
+
+	return scull_recv(c, &msg, NULL) < 0 ? -1 : 0;
+}
+
 typedef int cmd_t;
 
 static cmd_t parse_arguments(int argc, const char **argv) {
@@ -91,7 +103,26 @@ static cmd_t parse_arguments(int argc, const char **argv) {
 			break;
 		}
 		break;
-	
+
+	case 't':
+	case 'f':
+		if(argc < 3) {
+			fprintf(stderr, "%s: Missing concurrency\n", argv[0]);
+			cmd = -1;
+			break;
+		}
+		g_concurrency = atoi(argv[2]);
+		if(g_concurrency < 1 || g_concurrency > LOADGEN_WORKERS_MAX) {
+			fprintf(stderr, "%s: Invalid value (%d) for "
+					"concurrency\n",
+					argv[0], g_concurrency);
+			cmd = -1;
+			break;
+		}
+		if(loadgen_parse(&g_lg, argc - 3, argv + 3) < 0)
+			cmd = -1;
+		break;
+
 	default:
 		fprintf(stderr, "%s: Invalid command\n", argv[0]);
 		cmd = -1;
@@ -105,12 +136,22 @@ ret:
 	return cmd;
 }
 
-static int do_op(int fd, cmd_t cmd) {
+static int do_op(scull_client *c, cmd_t cmd) {
 	int ret;
 
 	switch(cmd) {
 	case 'p':
-		ret = do_procs(fd);
+		ret = do_procs(c);
+		break;
+	case 't':
+	case 'f':
+		g_lg.path = CDEV_NAME;
+		g_lg.flags = O_RDONLY;
+		g_lg.events = POLLIN;
+		g_lg.workers = g_concurrency;
+		g_lg.forked = (cmd == 'f');
+		g_lg.op = consume_one;
+		ret = loadgen_run(&g_lg);
 		break;
 	default:
 		/* Should never occur */
@@ -118,31 +159,33 @@ static int do_op(int fd, cmd_t cmd) {
 		ret = -1; /* Keep the compiler happy */
 	}
 
-	if(ret != 0)
+	if(ret != 0 && cmd == 'p') //the load generators say what went wrong themselves
 		perror("ioctl");
 	return ret;
 }
 
 int main(int argc, const char **argv) {
-	int fd, ret;
+	scull_client c;
+	int ret;
 	cmd_t cmd;
 
 	cmd = parse_arguments(argc, argv);
 
-	fd = open(CDEV_NAME, O_RDONLY);
-	if(fd < 0) {
+	//the load generators open the device once per worker themselves
+	if(cmd == 't' || cmd == 'f')
+		return (do_op(NULL, cmd) != 0)? EXIT_FAILURE : EXIT_SUCCESS;
+
+	//each child takes exactly one message, so batches of one
+	if(scull_client_open(&c, CDEV_NAME, O_RDONLY, 0, 1) != 0) {
 		perror("cdev open");
 		return EXIT_FAILURE;
 	}
 
 	printf("Device (%s) opened\n", CDEV_NAME);
 
-	ret = do_op(fd, cmd);
+	ret = do_op(&c, cmd);
 
-	if(close(fd) != 0) {
-		perror("cdev close");
-		return EXIT_FAILURE;
-	}
+	scull_client_close(&c);
 
 	printf("Device (%s) closed\n", CDEV_NAME);
 
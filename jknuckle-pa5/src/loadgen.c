@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "loadgen.h"
+
+/* what the parent reads back once a worker is done */
+struct loadgen_stat {
+	unsigned long msgs;
+	double secs;
+	int cpu;
+	int err;		/* errno that stopped it, 0 if none */
+};
+
+/*
+ * Lives in MAP_SHARED memory so pre-forked children can use the
+ * barrier and report back the same way threads do.
+ */
+struct loadgen_shared {
+	pthread_barrier_t start;
+	struct loadgen_stat stat[];
+};
+
+struct loadgen_worker {
+	struct loadgen *lg;
+	struct loadgen_shared *sh;
+	int id;
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* "0,2,4-7" */
+static int parse_cpus(struct loadgen *lg, const char *s) {
+	int lo, hi, n;
+	const char *p = s;
+	char *end;
+
+	for(n = 0; ; ) {
+		lo = hi = strtol(p, &end, 10);
+		if(end == p || lo < 0)
+			return -1;
+		p = end;
+		if(*p == '-') {
+			hi = strtol(++p, &end, 10);
+			if(end == p || hi < lo)
+				return -1;
+			p = end;
+		}
+		lg->cpus = realloc(lg->cpus, (n + hi - lo + 1) * sizeof(int));
+		if(lg->cpus == NULL)
+			return -1;
+		while(lo <= hi)
+			lg->cpus[n++] = lo++;
+		if(*p == '\0')
+			break;
+		if(*p++ != ',')
+			return -1;
+	}
+	lg->ncpus = n;
+	return 0;
+}
+
+int loadgen_parse(struct loadgen *lg, int argc, const char **argv) {
+	int i;
+
+	lg->batch = 1;
+	lg->count = LOADGEN_COUNT_DEFAULT;
+	lg->duration = 0;
+	lg->cpus = NULL;
+	lg->ncpus = 0;
+
+	for(i = 0; i < argc; i++) {
+		if(argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 == argc) {
+			fprintf(stderr, "Invalid option (%s)\n", argv[i]);
+			return -1;
+		}
+		switch(argv[i][1]) {
+		case 'n':
+			lg->count = strtoul(argv[++i], NULL, 10);
+			if(lg->count == 0) {
+				fprintf(stderr, "Invalid message count (%s)\n", argv[i]);
+				return -1;
+			}
+			break;
+		case 'd':
+			lg->duration = atof(argv[++i]);
+			if(lg->duration <= 0) {
+				fprintf(stderr, "Invalid duration (%s)\n", argv[i]);
+				return -1;
+			}
+			break;
+		case 'c':
+			if(parse_cpus(lg, argv[++i]) < 0) {
+				fprintf(stderr, "Invalid CPU list (%s)\n", argv[i]);
+				return -1;
+			}
+			break;
+		case 'b':
+			lg->batch = atoi(argv[++i]);
+			if(lg->batch < 1 || lg->batch > SCULL_CLIENT_BATCH_MAX) {
+				fprintf(stderr, "Invalid batch (%s), MIN: 1, MAX: %d\n",
+						argv[i], SCULL_CLIENT_BATCH_MAX);
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Invalid option (%s)\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *worker(void *arg) {
+	struct loadgen_worker *w = arg;
+	struct loadgen *lg = w->lg;
+	struct loadgen_stat *st = &w->sh->stat[w->id];
+	struct pollfd pfd;
+	scull_client c;
+	cpu_set_t set;
+	double t0, deadline = 0;
+	int flags = lg->flags, ok;
+
+	st->cpu = -1;
+	if(lg->ncpus) {
+		st->cpu = lg->cpus[w->id % lg->ncpus];
+		CPU_ZERO(&set);
+		CPU_SET(st->cpu, &set);
+		//0 is the calling thread, not the whole process
+		if(sched_setaffinity(0, sizeof(set), &set) < 0)
+			st->err = errno;
+	}
+
+	//a timed run mustn't sit in a blocking call past its end
+	if(lg->duration > 0)
+		flags |= O_NONBLOCK;
+	ok = !st->err && scull_client_open(&c, lg->path, flags, 0, lg->batch) == 0;
+	if(!ok && !st->err)
+		st->err = errno;
+
+	//everybody starts together, even the ones that failed to set up
+	pthread_barrier_wait(&w->sh->start);
+	if(!ok)
+		return NULL;
+
+	t0 = now();
+	if(lg->duration > 0)
+		deadline = t0 + lg->duration;
+	pfd.fd = c.fd;
+	pfd.events = lg->events;
+
+	for(;;) {
+		if(lg->duration > 0) {
+			if(now() >= deadline)
+				break;
+		} else if(st->msgs == lg->count)
+			break;
+		else
+			c.want = lg->count - st->msgs; //don't fetch what the other workers need
+
+		if(lg->op(&c, lg->arg) == 0) {
+			st->msgs++;
+		} else if(errno == EAGAIN && lg->duration > 0) {
+			poll(&pfd, 1, 10); //short, so we notice the deadline
+		} else {
+			st->err = errno;
+			break;
+		}
+	}
+	//a writer's last batch is still ours; what can't go in didn't happen
+	if(scull_flush(&c) < 0) {
+		st->msgs -= c.wcount;
+		if(!st->err && errno != EAGAIN)
+			st->err = errno;
+		c.wcount = 0; //not counted, so close mustn't send them either
+	}
+	st->secs = now() - t0;
+
+	scull_client_close(&c);
+	return NULL;
+}
+
+int loadgen_run(struct loadgen *lg) {
+	struct loadgen_shared *sh;
+	struct loadgen_worker *w;
+	pthread_barrierattr_t attr;
+	pthread_t *tid = NULL;
+	pid_t *pid = NULL;
+	size_t size;
+	unsigned long total = 0;
+	double secs = 0;
+	int i, n = 0, ret = 0;
+
+	size = sizeof(*sh) + lg->workers * sizeof(sh->stat[0]);
+	sh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(sh == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	w = calloc(lg->workers, sizeof(*w));
+	if(lg->forked)
+		pid = calloc(lg->workers, sizeof(*pid));
+	else
+		tid = calloc(lg->workers, sizeof(*tid));
+	if(w == NULL || (pid == NULL && tid == NULL)) {
+		perror("calloc");
+		ret = -1;
+		goto out;
+	}
+
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->start, &attr, lg->workers);
+	pthread_barrierattr_destroy(&attr);
+
+	/*
+	 * The barrier counts every worker, so if we can't start them all
+	 * the ones already waiting would hang; give up on the lot.
+	 */
+	for(n = 0; n < lg->workers; n++) {
+		w[n].lg = lg;
+		w[n].sh = sh;
+		w[n].id = n;
+		if(lg->forked) {
+			pid[n] = fork();
+			if(pid[n] == 0) {
+				worker(&w[n]);
+				_exit(EXIT_SUCCESS);
+			} else if(pid[n] < 0) {
+				perror("cannot fork more children");
+				break;
+			}
+		} else if((errno = pthread_create(&tid[n], NULL, worker, &w[n])) != 0) {
+			perror("cannot create more threads");
+			break;
+		}
+	}
+	if(n < lg->workers) {
+		if(lg->forked) {
+			for(i = 0; i < n; i++)
+				kill(pid[i], SIGKILL);
+		} else {
+			fprintf(stderr, "%d worker(s) stuck on the start barrier\n", n);
+			exit(EXIT_FAILURE);
+		}
+		ret = -1;
+	}
+	for(i = 0; i < n; i++) {
+		if(lg->forked)
+			waitpid(pid[i], NULL, 0);
+		else
+			pthread_join(tid[i], NULL);
+	}
+	if(ret)
+		goto out_barrier;
+
+	for(i = 0; i < lg->workers; i++) {
+		struct loadgen_stat *st = &sh->stat[i];
+
+		printf("worker %d (cpu %d): %lu msgs in %.3f s, %.0f msgs/s",
+		       i, st->cpu, st->msgs, st->secs,
+		       st->secs > 0 ? st->msgs / st->secs : 0.0);
+		if(st->err) {
+			printf(", stopped: %s", strerror(st->err));
+			ret = -1;
+		}
+		printf("\n");
+		total += st->msgs;
+		if(st->secs > secs)
+			secs = st->secs;
+	}
+	//the slowest worker's time, since they all started together
+	printf("total: %lu msgs in %.3f s, %.0f msgs/s\n",
+	       total, secs, secs > 0 ? total / secs : 0.0);
+
+out_barrier:
+	pthread_barrier_destroy(&sh->start);
+out:
+	free(w);
+	free(pid);
+	free(tid);
+	free(lg->cpus);
+	munmap(sh, size);
+	return ret;
+}
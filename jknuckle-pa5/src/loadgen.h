@@ -0,0 +1,51 @@
+/*
+ * loadgen.h -- long-running load generator for producer/consumer
+ *
+ * Starts a fixed set of workers (threads or pre-forked processes),
+ * each pinned to a CPU and holding its own scull_client, lines them
+ * up on a barrier, then has each one call op() until it has done
+ * count messages or duration seconds have gone by. Nothing is forked
+ * or opened on the measured path.
+ */
+#ifndef _LOADGEN_H_
+#define _LOADGEN_H_
+
+#include "scull_client.h"
+
+#define LOADGEN_WORKERS_MAX 1024
+#define LOADGEN_COUNT_DEFAULT 100000
+
+/*
+ * One message. Returns 0, or -1 with errno set; EAGAIN (only seen in
+ * duration mode, where the device is opened O_NONBLOCK) means "wait
+ * and try again", anything else stops the worker.
+ */
+typedef int (*loadgen_op)(scull_client *c, void *arg);
+
+struct loadgen {
+	const char *path;
+	int flags;		/* O_RDONLY or O_WRONLY */
+	int events;		/* POLLIN or POLLOUT, what op() waits for */
+	loadgen_op op;
+	void *arg;
+
+	int workers;
+	int forked;		/* processes instead of threads */
+	unsigned int batch;	/* scull_client batch, -b */
+	unsigned long count;	/* messages per worker, -n */
+	double duration;	/* seconds, -d; wins over count */
+	int *cpus;		/* worker i runs on cpus[i % ncpus], -c */
+	int ncpus;		/* 0: don't pin */
+};
+
+/*
+ * Fill in the options from argv ("-n <msgs>", "-d <secs>",
+ * "-c <cpu list>", "-b <batch>"). Returns 0, or -1 after printing
+ * what was wrong.
+ */
+int loadgen_parse(struct loadgen *lg, int argc, const char **argv);
+
+/* run it and print per-worker and total rates; 0 if every worker was fine */
+int loadgen_run(struct loadgen *lg);
+
+#endif /* _LOADGEN_H_ */
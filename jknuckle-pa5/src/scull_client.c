@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "scull_client.h"
+
+int scull_client_open(scull_client *c, const char *path, int flags,
+		      unsigned int nbufs, unsigned int batch) {
+	unsigned int i;
+	int elemsz, maxmsg, saved;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	if(batch < 1 || batch > SCULL_CLIENT_BATCH_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c->fd = open(path, flags);
+	if(c->fd < 0)
+		return -1;
+
+	//ask once, not on every message
+	elemsz = ioctl(c->fd, SCULL_IOCGETELEMSZ);
+	maxmsg = ioctl(c->fd, SCULL_IOCGETMAXMSG);
+	c->lanes = ioctl(c->fd, SCULL_IOCGETLANES);
+	c->groups = ioctl(c->fd, SCULL_IOCGETGROUPS);
+	if(elemsz < 0 || maxmsg < 0 || c->lanes < 0 || c->groups < 0)
+		goto fail;
+	c->elemsz = elemsz;
+	c->maxmsg = maxmsg;
+
+	//the write batch lives in pool buffers
+	if(batch > 1 && (flags & O_ACCMODE) != O_RDONLY) {
+		nbufs += batch;
+		c->wmsg = malloc(batch * sizeof(struct scull_msg));
+		if(c->wmsg == NULL)
+			goto fail;
+	}
+	c->nbufs = nbufs;
+	if(nbufs) {
+		c->pool = malloc(nbufs * (c->maxmsg + 1));
+		c->free = malloc(nbufs * sizeof(char *));
+		if(c->pool == NULL || c->free == NULL)
+			goto fail;
+		for(i = 0; i < nbufs; i++)
+			c->free[i] = c->pool + i * (c->maxmsg + 1);
+		c->nfree = nbufs;
+	}
+
+	//a batch is only borrowed until it has all been handed out
+	if(batch > 1 && (flags & O_ACCMODE) != O_WRONLY &&
+	   ioctl(c->fd, SCULL_IOCTPEEK, 1) < 0)
+		goto fail;
+
+	//a whole batch of the biggest messages always fits
+	c->batch = batch;
+	c->rbuflen = batch * c->maxmsg;
+	c->desc = malloc(batch * sizeof(struct scull_desc));
+	c->rbuf = malloc(c->rbuflen ? c->rbuflen : 1);
+	if(c->desc == NULL || c->rbuf == NULL)
+		goto fail;
+	return 0;
+
+fail:
+	saved = errno;
+	scull_client_close(c);
+	errno = saved;
+	return -1;
+}
+
+void scull_client_close(scull_client *c) {
+	if(c->fd >= 0) {
+		scull_flush(c); //best effort, nobody is left to tell
+		//keep what we handed out, the driver gives the rest back on close
+		if(c->batch > 1 && c->next > 0)
+			ioctl(c->fd, SCULL_IOCTCOMMIT, c->next);
+		close(c->fd);
+	}
+	free(c->pool);
+	free(c->free);
+	free(c->wmsg);
+	free(c->desc);
+	free(c->rbuf);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+char *scull_buf_get(scull_client *c) {
+	if(c->nfree == 0 && c->wcount > 0 && scull_flush(c) < 0 && c->nfree == 0)
+		return NULL; //the batch holds them and can't go yet, errno says why
+	if(c->nfree == 0) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+	return c->free[--c->nfree];
+}
+
+void scull_buf_put(scull_client *c, char *buf) {
+	if(buf != NULL)
+		c->free[c->nfree++] = buf;
+}
+
+int scull_flush(scull_client *c) {
+	struct scull_burst b;
+	unsigned int i;
+	int n;
+
+	while(c->wcount > 0) {
+		b.msgs = (unsigned long)c->wmsg;
+		b.count = c->wcount;
+		n = ioctl(c->fd, SCULL_IOCBURST, &b);
+		if(n < 0)
+			return -1;
+		//these went, their buffers come back; a short count means the next one will tell us why
+		for(i = 0; i < (unsigned int)n; i++)
+			scull_buf_put(c, (char *)(unsigned long)c->wmsg[i].buf);
+		c->wcount -= n;
+		memmove(c->wmsg, c->wmsg + n, c->wcount * sizeof(struct scull_msg));
+	}
+	return 0;
+}
+
+ssize_t scull_buf_send(scull_client *c, char *buf, size_t len) {
+	ssize_t ret;
+
+	if(len > c->maxmsg) { //the driver would say EMSGSIZE, don't bother it
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if(c->wmsg == NULL) { //no write batch
+		ret = write(c->fd, buf, len);
+		if(ret >= 0)
+			scull_buf_put(c, buf);
+		return ret;
+	}
+	//a full batch has to go before this one can wait behind it
+	if(c->wcount == c->batch && scull_flush(c) < 0)
+		return -1;
+	c->wmsg[c->wcount].buf = (unsigned long)buf;
+	c->wmsg[c->wcount].len = len;
+	c->wcount++;
+	if(c->wcount == c->batch)
+		scull_flush(c); //queued either way, a failure shows up next time
+	return len;
+}
+
+ssize_t scull_send(scull_client *c, const void *msg, size_t len) {
+	ssize_t ret;
+	char *buf;
+
+	if(len > c->maxmsg) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if(c->wmsg == NULL)
+		return write(c->fd, msg, len);
+	buf = scull_buf_get(c);
+	if(buf == NULL)
+		return -1;
+	memcpy(buf, msg, len);
+	ret = scull_buf_send(c, buf, len);
+	if(ret < 0)
+		scull_buf_put(c, buf);
+	return ret;
+}
+
+int scull_sendv(scull_client *c, const void *const *msgs, const size_t *len, int n) {
+	struct scull_msg m[SCULL_CLIENT_BATCH_MAX];
+	struct scull_burst b;
+	int i = 0, k, done;
+
+	if(scull_flush(c) < 0) //they were first
+		return -1;
+	while(i < n) {
+		for(k = 0; k < SCULL_CLIENT_BATCH_MAX && i + k < n; k++) {
+			m[k].buf = (unsigned long)msgs[i + k];
+			m[k].len = len[i + k];
+		}
+		b.msgs = (unsigned long)m;
+		b.count = k;
+		done = ioctl(c->fd, SCULL_IOCBURST, &b);
+		if(done < 0) //after a short count this is the one that stopped it
+			return i ? i : -1;
+		i += done;
+	}
+	return i;
+}
+
+/* refill the batch, one DRAIN, after committing the last one */
+static int fill(scull_client *c) {
+	struct scull_drain d = {
+		.desc = (unsigned long)c->desc,
+		.buf = (unsigned long)c->rbuf,
+		.buflen = c->rbuflen,
+		.max = c->want && c->want < c->batch ? c->want : c->batch,
+	};
+	int n;
+
+	if(c->batch > 1 && c->have > 0) { //all handed out, let them go
+		if(ioctl(c->fd, SCULL_IOCTCOMMIT, 0) < 0)
+			return -1;
+		c->have = c->next = 0;
+	}
+	n = ioctl(c->fd, SCULL_IOCDRAIN, &d);
+	if(n < 0)
+		return -1;
+	c->have = n;
+	c->next = 0;
+	return 0;
+}
+
+ssize_t scull_recv(scull_client *c, const char **msg, struct scull_desc *desc) {
+	struct scull_desc *d;
+
+	if(c->next == c->have && fill(c) < 0)
+		return -1;
+	d = &c->desc[c->next++];
+	*msg = c->rbuf + d->offset;
+	if(desc != NULL)
+		*desc = *d;
+	return d->len;
+}
+
+ssize_t scull_recv_copy(scull_client *c, void *buf, size_t size) {
+	const char *msg;
+	ssize_t len;
+
+	len = scull_recv(c, &msg, NULL);
+	if(len < 0)
+		return -1;
+	if((size_t)len > size)
+		len = size;
+	memcpy(buf, msg, len);
+	return len;
+}
@@ -0,0 +1,111 @@
+/*
+ * scull_client.h -- small client library for the scull FIFO
+ *
+ * Opens the device once, caches its parameters, keeps a pool of
+ * message sized buffers, and reads and writes in batches, with
+ * SCULL_IOCDRAIN and SCULL_IOCBURST, so most scull_recv() and
+ * scull_send() calls never enter the kernel.
+ *
+ * A batch bigger than one puts the fd in peek mode (SCULL_IOCTPEEK):
+ * DRAIN then only borrows the messages, and they are committed once
+ * scull_recv() has handed them all out, just before the next DRAIN.
+ * Closing the client commits the ones it handed out and gives the rest
+ * of the batch back to the consumer group, so nothing is lost because
+ * a client fetched more than it ended up wanting.
+ *
+ * On the write side a batch bigger than one keeps messages in pool
+ * buffers until batch of them are queued (or scull_flush()), then hands
+ * them all to the driver in one SCULL_IOCBURST. A flush that fails
+ * keeps what didn't go; the next scull_send() or scull_flush() tries
+ * again. Closing the client flushes what's left.
+ *
+ * A client is not thread-safe: use one per thread (or per process,
+ * opening it after fork() so the batch isn't shared).
+ */
+#ifndef _SCULL_CLIENT_H_
+#define _SCULL_CLIENT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "scull.h"
+
+#define SCULL_CLIENT_BATCH_MAX SCULL_PEEK_MAX /* what peek mode can hold */
+
+typedef struct {
+	int fd;
+	/* device parameters, asked for once */
+	size_t elemsz;		/* SCULL_IOCGETELEMSZ */
+	size_t maxmsg;		/* SCULL_IOCGETMAXMSG, the biggest message */
+	int lanes;		/* SCULL_IOCGETLANES */
+	int groups;		/* SCULL_IOCGETGROUPS */
+
+	/* buffer pool, see scull_buf_get() */
+	char *pool;		/* nbufs buffers of maxmsg + 1 bytes */
+	char **free;		/* stack of the ones not handed out */
+	unsigned int nbufs, nfree;
+
+	/* write batch, pool buffers waiting for SCULL_IOCBURST */
+	struct scull_msg *wmsg;
+	unsigned int wcount;	/* messages in it */
+
+	/* read batch, filled by SCULL_IOCDRAIN */
+	unsigned int batch;	/* messages per DRAIN */
+	struct scull_desc *desc;
+	char *rbuf;		/* their payloads */
+	size_t rbuflen;
+	unsigned int have;	/* messages in the batch */
+	unsigned int next;	/* next one scull_recv() hands out */
+	unsigned long want;	/* set by the caller: DRAIN no more than this, 0 = batch */
+} scull_client;
+
+/*
+ * Open @path with @flags (O_RDONLY, O_WRONLY, O_RDWR, maybe
+ * O_NONBLOCK). @nbufs buffers go in the pool, and reads and writes
+ * move up to @batch messages at a time (1 is one syscall per message,
+ * like read() and write(), and needs no peek mode). A writer's pool
+ * gets another @batch buffers for the write batch. Returns 0 or -1
+ * with errno set.
+ */
+int scull_client_open(scull_client *c, const char *path, int flags,
+		      unsigned int nbufs, unsigned int batch);
+void scull_client_close(scull_client *c);
+
+/*
+ * Buffers of maxmsg + 1 bytes (room for a '\0' after the biggest
+ * message). NULL when the pool is empty even after a flush.
+ */
+char *scull_buf_get(scull_client *c);
+void scull_buf_put(scull_client *c, char *buf);
+
+/*
+ * Queue the message built in pool buffer @buf, which then belongs to
+ * the client again, and send it with the rest of the batch. Returns
+ * len, or -1 with errno set and @buf still the caller's.
+ */
+ssize_t scull_buf_send(scull_client *c, char *buf, size_t len);
+
+/* one message, copied into a pool buffer if it waits for a batch */
+ssize_t scull_send(scull_client *c, const void *msg, size_t len);
+
+/*
+ * @n messages of @len[i] bytes, after whatever is queued, with one
+ * SCULL_IOCBURST per batch. Returns how many went, -1 if none did.
+ */
+int scull_sendv(scull_client *c, const void *const *msgs, const size_t *len, int n);
+
+/* send the write batch now; 0, or -1 with what didn't go still queued */
+int scull_flush(scull_client *c);
+
+/*
+ * Next message. Points *msg at it inside the batch, valid until the
+ * next scull_recv(), and fills in *desc if that isn't NULL. Returns
+ * its length, or -1 with errno set (EAGAIN for O_NONBLOCK and nothing
+ * queued).
+ */
+ssize_t scull_recv(scull_client *c, const char **msg, struct scull_desc *desc);
+
+/* the same, copied into @buf of @size bytes and cut short if need be */
+ssize_t scull_recv_copy(scull_client *c, void *buf, size_t size);
+
+#endif /* _SCULL_CLIENT_H_ */